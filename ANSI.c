@@ -229,6 +229,37 @@
 
   v1.89, 29 April, 2019:
     an eight-digit window handle would break my custom printf.
+
+  v1.90, 17 October, 2026:
+    drive the parser from character class and state transition tables;
+    RIS returns to normal text (the next character was treated as a sequence);
+    add runs of text to the buffer at once, rather than each character;
+    write long runs of text directly, bypassing the buffer;
+    convert UTF-8 in pieces as it's parsed, widening ASCII directly;
+    keep a parser state for each handle and don't flush when switching;
+    don't set the attribute until something is written;
+    don't move the cursor until something needs it;
+    only ask for the console info when it could have changed;
+    add log level 64 to log performance counters;
+    add ANSICON_GRID to keep the window in memory, writing only what changed;
+    work out wrapping from the text, using the console only when unsure;
+    keep the buffer used to test wrapping, rather than creating it each time;
+    write a full buffer in the background, while filling another;
+    flush interactive output straight away, streams after a growing delay;
+    add ANSICON_FLUSH to set the delays;
+    grow the buffer to collect large output (up to ANSICON_BUFFER);
+    jump scroll: scroll a buffer's lines at once, skipping those that scroll
+     off the top; add \e[?4h & \e[?4l to select smooth/jump scroll (DECSCLM);
+    scroll a run of LF, NEL, IND or RI at once;
+    only write the last of the lines rewritten using CR between flushes;
+    only read ANSICON_DEF again when it's set (hook SetEnvironmentVariable);
+    only read the program lists again when a variable is set, hashing them;
+    keep more handles (including non-console) and find them without locking;
+    only flush for ReadFile & CloseHandle when it's the console;
+    answer GetConsoleScreenBufferInfo(Ex) from what's pending, if possible;
+    track the pending wrap, rather than reading the line to drop a newline;
+    remember the nearest color of RGB & 256-color SGR;
+    add ANSICON_NEAREST to find the nearest color using Oklab.
 */
 
 #include "ansicon.h"
@@ -243,6 +274,12 @@ typedef BOOL (WINAPI *FnPlaySound)( LPCWSTR, HMODULE, DWORD );
 FnPlaySound PlaySound;
 HMODULE winmm;
 
+// SSE2 is always available to 64-bit, but 32-bit still supports Windows 2000.
+#if defined(_WIN64) || defined(__SSE2__) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define HAVE_SSE2
+#endif
+
 #define is_digit(c) ('0' <= (c) && (c) <= '9')
 
 // ========== Global variables and constants
@@ -252,15 +289,22 @@ WORD	orgattr;		// original attributes
 DWORD	orgmode;		// original mode
 CONSOLE_CURSOR_INFO orgcci;	// original cursor state
 HANDLE	hHeap;			// local memory heap
-HANDLE	hBell, hFlush;
+HANDLE	hBell, hFlush, hWriter;
 BOOL	ansicon;		// are we in ansicon.exe?
 
-#define CACHE	5
-struct Cache
+// Handles that have been checked for the console, with their mode (0 if not
+// the console).  It's looked up without locking: an entry is only changed
+// with CritSect, its seq being odd while it is.
+#define HANDLES 64		// size of the table (a power of two)
+#define CON_HANDLE 0x80000000	// added to the mode of a console handle
+struct Handle
 {
-  HANDLE h;
-  DWORD  mode;
-} cache[CACHE];
+  volatile LONG   seq;
+  HANDLE volatile h;
+  volatile DWORD  mode;
+} handles[HANDLES];
+#define HANDLE_SLOT( h ) (handles + (((DWORD_PTR)(h) >> 2) & (HANDLES - 1)))
+DWORD	conmode;		// mode of the console handle being written
 
 #define ESC	'\x1B'          // ESCape character
 #define BEL	'\x07'          // BELl
@@ -283,6 +327,9 @@ BOOL  shifted, G0_special, SaveG0;
 BOOL  wm = FALSE;		// does program detect wrap itself?
 BOOL  awm = TRUE;		// autowrap mode
 BOOL  im;			// insert mode
+BOOL  sm;			// smooth scroll mode (otherwise jump scroll)
+int   def_attr;			// ANSICON_DEF, as read by get_default_attr
+BOOL  def_attr_valid;		// def_attr can be used
 int   screen_top = -1;		// initial window top when cleared
 
 
@@ -498,6 +545,13 @@ BOOL   valid_state;
 HANDLE hMap;
 
 #include "palette.h"
+#include "grid.h"
+#include "flush.h"
+#include "text.h"
+#include "proglist.h"
+#include "oklab.h"
+#include "parse.h"
+#include "scroll.h"
 
 void set_ansicon( PCONSOLE_SCREEN_BUFFER_INFO );
 
@@ -580,72 +634,198 @@ void get_state( void )
     }
     ac_wprintf( a, "%X", ATTR & 255 );
     SetEnvironmentVariable( L"ANSICON_DEF", def );
+    def_attr_valid = FALSE;
     set_ansicon( &Info );
     CloseHandle( hConOut );
   }
 }
 
 
-// Search an environment variable for a string.
-BOOL search_env( LPCTSTR var, LPCTSTR val )
+// The lists of programs (or modules) in ANSICON_API, ANSICON_EXC, etc.  Each
+// is only read again after a variable has been set (which is rare), with the
+// names hashed (see proglist.h), so a search needn't compare every one.
+typedef struct
 {
-  static LPTSTR env;
-  static DWORD	env_len;
-  DWORD  len;
-  BOOL	 not;
-  LPTSTR end;
+  LPCTSTR var;			// the variable
+  LPTSTR  buf;			// its value (holding the names)
+  LPTSTR* slot; 		// the hash table
+  PLIST   pl;			// its names
+} PROGLIST, *PPROGLIST;
 
-  len = GetEnvironmentVariable( var, env, env_len );
-  if (len == 0)
-    return FALSE;
+enum { ENV_API, ENV_EXC, ENV_GUI, ENV_WRAP, ENV_GRID };
+
+PROGLIST prog_list[] =
+{
+  { L"ANSICON_API" },
+  { L"ANSICON_EXC" },
+  { L"ANSICON_GUI" },
+  { L"ANSICON_WRAP" },
+  { L"ANSICON_GRID" },
+};
+
+volatile LONG env_gen = 1;	// changed whenever a variable is set
+CRITICAL_SECTION EnvSect;
+
+DWORD stat_list_read;		// program lists read
+DWORD stat_list_search; 	// program lists searched
+
+
+// Read a list from its variable.
+void read_list( PPROGLIST list )
+{
+  DWORD len, size;
 
-  if (len > env_len)
+  if (list->buf != NULL)
   {
-    LPTSTR tmp = (env == NULL) ? HeapAlloc( hHeap, 0, TSIZE(len) )
-			       : HeapReAlloc( hHeap, 0, env, TSIZE(len) );
-    if (tmp == NULL)
-      return FALSE;
-    env = tmp;
-    env_len = (DWORD)HeapSize( hHeap, 0, env );
-    GetEnvironmentVariable( var, env, env_len );
+    HeapFree( hHeap, 0, list->buf );
+    list->buf = NULL;
   }
+  if (list->slot != NULL)
+  {
+    HeapFree( hHeap, 0, list->slot );
+    list->slot = NULL;
+  }
+  ++stat_list_read;
 
-  not = (*env == '!');
-  if (not && env[1] == '\0')
-    return TRUE;
-
-  end = env + not;
-  while (*end != '\0')
+  len = GetEnvironmentVariable( list->var, NULL, 0 );
+  if (len != 0)
   {
-    var = end;
-    do
+    list->buf = HeapAlloc( hHeap, 0, TSIZE(len) );
+    if (list->buf == NULL)
     {
-      if (*end++ == ';')
-      {
-	end[-1] = '\0';
-	break;
-      }
-    } while (*end != '\0');
-    if (lstrcmpi( val, var ) == 0)
-      return !not;
+      pl_split( &list->pl, NULL, 0 );
+      return;
+    }
+    if (GetEnvironmentVariable( list->var, list->buf, len ) >= len)
+      *list->buf = '\0';       // it's just been changed, so it'll be read again
+  }
+  size = pl_split( &list->pl, list->buf, env_gen );
+  if (size != 0)
+  {
+    // Without the table, every name is compared.
+    list->slot = HeapAlloc( hHeap, 0, size * sizeof(LPTSTR) );
+    if (list->slot != NULL)
+      pl_hash( &list->pl, list->slot, size );
   }
+}
+
+
+int cmp_name( const unsigned short* a, const unsigned short* b )
+{
+  return lstrcmpi( a, b );
+}
 
-  return not;
+
+// Search an environment variable (ENV_*) for a string.
+BOOL search_env( int var, LPCTSTR val )
+{
+  PPROGLIST list = prog_list + var;
+  BOOL	    found;
+
+  EnterCriticalSection( &EnvSect );
+  ++stat_list_search;
+  if (list->pl.gen != env_gen)
+    read_list( list );
+  found = pl_find( &list->pl, val, cmp_name );
+  LeaveCriticalSection( &EnvSect );
+
+  return found;
 }
 
 
 // ========== Print Buffer functions
 
-#define BUFFER_SIZE 2048
+#define BUFFER_SIZE 2048		// initial size of the buffer
+#define DIRECT_MAX  (8 * BUFFER_SIZE)	// longest text written directly
 
 int   nCharInBuffer;
-WCHAR ChBuffer[BUFFER_SIZE];
+int   nLinesInBuffer;		// newlines in the buffer (jump scroll)
+WCHAR ChBuffers[2][BUFFER_SIZE];
+LPWSTR ChBuffer = ChBuffers[0]; // the one being filled
+LPWSTR ChSpare	= ChBuffers[1]; // the one being written
+int   nBufferSize = BUFFER_SIZE;	// size of ChBuffer
+int   nSpareSize  = BUFFER_SIZE;	// size of ChSpare
+int   nBufferMax  = DIRECT_MAX; 	// largest it can grow (ANSICON_BUFFER)
+HANDLE hPending;		// handle the buffer will be written to
 WCHAR ChPrev;
 int   nWrapped;
+BOOL  wrap_pend;		// only blanks since the last wrap (drop newline)
 CRITICAL_SECTION CritSect;
 HANDLE hFlushTimer;
+FLUSH flush = { 15, 60 };	// delays before flushing (milliseconds); the
+				//  longest is also the pause before output is
+				//  taken to be interactive
+int   pending_attr = -1;	// attribute to set before writing (-1 for none)
+COORD pending_pos;		// cursor position to set before writing
+BOOL  pending_move;		// pending_pos is valid
+CONSOLE_SCREEN_BUFFER_INFO csbi; // shadow of hConOut's info
+BOOL  csbi_valid;		// csbi can be used instead of asking
+
+// Performance counters, logged at exit with log level 64.
+DWORD stat_info;		// console info requests
+DWORD stat_query;		// console info queries
+DWORD stat_wrap_predict;	// writes with wrapping worked out
+DWORD stat_wrap_test;		// writes with wrapping tested by the console
+DWORD stat_write_queued;	// writes done in the background
+DWORD stat_buffer_grow; 	// times the buffer was made bigger
+DWORD stat_flush_len;		// most characters written at once
+DWORD stat_jump;		// times lines were scrolled at once
+DWORD stat_jump_lines;		// lines scrolled by them
+DWORD stat_cr_coalesce; 	// lines rewritten in the buffer
+DWORD stat_handle_hit;		// handles found in the table
+DWORD stat_handle_miss; 	// handles checked for the console
+DWORD stat_read_skip;		// ReadFile not on the console (no flush)
+DWORD stat_close_skip;		// CloseHandle not needing a flush
+DWORD stat_query_model; 	// console info answered without a flush
+DWORD stat_color_hit;		// nearest colors remembered
+DWORD stat_color_miss;		// nearest colors found
+DWORD stat_palette;		// times the palette changed
+
+// Why the buffer was written.
+enum
+{
+  FR_SEQ,			// a control or sequence needed it
+  FR_FULL,			// it was full
+  FR_NEWLINE,			// a newline
+  FR_TIMER,			// the flush timer
+  FR_HOOK,			// the program used the console itself
+  FR_WRITE,			// at the end of the write
+  FR_EXIT,			// the program is ending
+  FR_COUNT
+};
+int   flush_why;		// reason for the next write
+DWORD stat_flush_why[FR_COUNT];
+
+// The background write.
+HANDLE	hWriteStart, hWriteDone;
+HANDLE	hWriteCon;
+LPCWSTR WriteBuf;
+DWORD	nWriteLen;
+BOOL	writing;		// a write has started and not been waited for
+
+
+// Wait for the background write to finish.  Anything that uses the console
+// (or the state the write has already updated) must do this first.  Only this
+// clears the flag, once the (auto-reset) event says the write is done, so a
+// write can't be mistaken as done by the signal of the previous one.
+void wait_writer( void )
+{
+  HANDLE h[2];
+
+  if (writing)
+  {
+    // Wait for the thread, too, in case it's been terminated.
+    h[0] = hWriteDone;
+    h[1] = hWriter;
+    WaitForMultipleObjects( 2, h, FALSE, INFINITE );
+    writing = FALSE;
+  }
+}
 
-void MoveDown( BOOL home );
+void MoveDown( BOOL home, int n );
+void scroll_lines( int top, int bottom, int n );
+void write_lines( LPCWSTR text, int len );
+const int* get_cells( void );
 
 
 // Well, this is annoying.  Setting the cursor position on any buffer always
@@ -658,6 +838,7 @@ BOOL SetConsoleCursorPos( HANDLE hConsoleOutput, COORD dwCursorPosition )
   CONSOLE_CURSOR_INFO CursInfo;
   BOOL rc;
 
+  wait_writer();
   GetConsoleCursorInfo( hConsoleOutput, &CursInfo );
   if (CursInfo.bVisible)
   {
@@ -670,31 +851,105 @@ BOOL SetConsoleCursorPos( HANDLE hConsoleOutput, COORD dwCursorPosition )
   else
     rc = SetConsoleCursorPosition( hConsoleOutput, dwCursorPosition );
 
+  // The window may have scrolled to show the cursor.
+  csbi_valid = FALSE;
+
   return rc;
 }
 
 
+// Move the cursor, but not until something needs it.
+void move_cursor( COORD pos )
+{
+  pending_pos  = pos;
+  pending_move = TRUE;
+}
+
+
 // Set the cursor position, resetting the wrap flag.
 void set_pos( int x, int y )
 {
   COORD pos = { x, y };
-  SetConsoleCursorPos( hConOut, pos );
+  move_cursor( pos );
   nWrapped = 0;
 }
 
 
+// Set the pending cursor position.
+void apply_pos( void )
+{
+  if (pending_move)
+  {
+    SetConsoleCursorPos( hConOut, pending_pos );
+    pending_move = FALSE;
+  }
+}
+
+
+// Set the attribute, but not until something is written.
+void set_attr( WORD attr )
+{
+  pending_attr = attr;
+}
+
+
+// Set the pending attribute.
+void apply_attr( void )
+{
+  if (pending_attr != -1)
+  {
+    wait_writer();
+    SetConsoleTextAttribute( hConOut, (WORD)pending_attr );
+    csbi.wAttributes = (WORD)pending_attr;
+    pending_attr = -1;
+  }
+}
+
+
+// Get the console info, with the attribute and cursor that will be used.  The
+// console is only asked when something may have changed it (writing, moving
+// the cursor, resizing, or the program accessing the console itself).
+BOOL get_info( PCONSOLE_SCREEN_BUFFER_INFO pInfo )
+{
+  wait_writer();
+  ++stat_info;
+  if (!csbi_valid)
+  {
+    ++stat_query;
+    if (!GetConsoleScreenBufferInfo( hConOut, pInfo ))
+      return FALSE;
+    csbi = *pInfo;
+    csbi_valid = TRUE;
+  }
+  else
+    *pInfo = csbi;
+  if (pending_attr != -1)
+    pInfo->wAttributes = (WORD)pending_attr;
+  if (pending_move)
+    pInfo->dwCursorPosition = pending_pos;
+  return TRUE;
+}
+
+
 // Get the default attribute, as-is if !ATTR (i.e. preserve negative), else for
-// the console (swap foreground/background if negative).
+// the console (swap foreground/background if negative).  The variable is only
+// read again after it's been set (by the hook below).
 int get_default_attr( BOOL attr )
 {
   TCHAR def[4];
   int	a;
 
-  *def = '7'; def[1] = '\0';
-  GetEnvironmentVariable( L"ANSICON_DEF", def, lenof(def) );
-  a = ac_wcstol( def, NULL, 16 );
-  if (a == 0)
-    a = (*def == '-') ? -7 : 7;
+  if (!def_attr_valid)
+  {
+    *def = '7'; def[1] = '\0';
+    GetEnvironmentVariable( L"ANSICON_DEF", def, lenof(def) );
+    a = ac_wcstol( def, NULL, 16 );
+    if (a == 0)
+      a = (*def == '-') ? -7 : 7;
+    def_attr = a;
+    def_attr_valid = TRUE;
+  }
+  a = def_attr;
   if (a > 0 || !attr)
     return a;
   a = -a;
@@ -702,96 +957,499 @@ int get_default_attr( BOOL attr )
 }
 
 
+// Double-byte code pages may use two cells for what would otherwise be narrow.
+BOOL is_dbcs_cp( void )
+{
+  UINT cp = GetConsoleOutputCP();
+  return (cp == 932 || cp == 936 || cp == 949 || cp == 950);
+}
+
+// ========== Grid functions
+
+// With ANSICON_GRID, a copy of the window is kept in memory.  Text, erasing,
+// scrolling, inserting and deleting update the copy, and the lines that have
+// changed are written to the console when the buffer would be flushed.  Any-
+// thing the grid can't do writes the changes and discards it (it's read again
+// when next needed).
+
+BOOL	   gm;			// grid mode
+HANDLE	   grid_h;		// handle the grid belongs to (NULL if none)
+GRID	   grid;		// the copy (see grid.h)
+PVOID	   grid_mem;		// memory for it
+DWORD	   grid_alloc;		// bytes allocated for it
+
+DWORD stat_grid_read;		// times the window was read
+DWORD stat_grid_flush;		// times changes were written
+DWORD stat_grid_rect;		// rectangles written
+
+#define GRID_CHUNK 6000 	// most cells to read or write at once
+
+
+// Read or write lines of the grid, in pieces the console can handle.
+BOOL grid_io( BOOL write, int row, int rows, SHORT left, SHORT right )
+{
+  COORD      size, pos;
+  SMALL_RECT r;
+  PCHAR_INFO cells;
+  int	     n;
+
+  n = GRID_CHUNK / grid.width;
+  if (n == 0)
+    n = 1;
+  size.X = grid.width;
+  pos.X  = left;
+  pos.Y  = 0;
+  r.Left  = left;
+  r.Right = right;
+  while (rows > 0)
+  {
+    if (n > rows)
+      n = rows;
+    size.Y   = n;
+    r.Top    = grid.top + row;
+    r.Bottom = r.Top + n - 1;
+    cells    = (PCHAR_INFO)(grid.cell + row * grid.width);
+    if (write)
+    {
+      ++stat_grid_rect;
+      if (!WriteConsoleOutput( grid_h, cells, size, pos, &r ))
+	return FALSE;
+    }
+    else if (!ReadConsoleOutput( grid_h, cells, size, pos, &r ))
+      return FALSE;
+    row  += n;
+    rows -= n;
+  }
+  return TRUE;
+}
+
+
+// Write the lines that have changed, joining adjacent lines into one
+// rectangle.
+void grid_flush( void )
+{
+  GRECT r;
+  int	row;
+
+  if (!grid.dirty)
+    return;
+  ++stat_grid_flush;
+  row = 0;
+  while (gr_next_rect( &grid, &row, &r ))
+    grid_io( TRUE, r.top, r.bottom - r.top + 1, r.left, r.right );
+}
+
+
+// Write any changes and discard the grid, so the console can be used directly.
+void grid_sync( void )
+{
+  if (grid_h != NULL)
+  {
+    grid_flush();
+    grid_h = NULL;
+  }
+}
+
+
+// Make sure the grid has the current window, reading it if necessary.
+BOOL grid_ready( void )
+{
+  CONSOLE_SCREEN_BUFFER_INFO Info;
+  DWORD size;
+  int	rows;
+
+  if (!gm)
+    return FALSE;
+  if (pState->crm || !get_info( &Info ))
+  {
+    grid_sync();
+    return FALSE;
+  }
+  rows = BOTTOM - TOP + 1;
+  if (grid_h != NULL)
+  {
+    if (grid_h == hConOut && grid.top == TOP && grid.width == WIDTH &&
+	grid.rows == rows)
+      return TRUE;
+    grid_sync();
+  }
+
+  if (is_dbcs_cp())
+    return FALSE;
+
+  size = GRID_SIZE( WIDTH, rows );
+  if (size > grid_alloc)
+  {
+    if (grid_mem != NULL)
+      HeapFree( hHeap, 0, grid_mem );
+    grid_mem = HeapAlloc( hHeap, 0, size );
+    if (grid_mem == NULL)
+    {
+      grid_alloc = 0;
+      return FALSE;
+    }
+    grid_alloc = size;
+  }
+  gr_init( &grid, grid_mem, TOP, WIDTH, rows );
+  grid_h = hConOut;
+  ++stat_grid_read;
+  if (!grid_io( FALSE, 0, rows, LEFT, RIGHT ))
+  {
+    grid_h = NULL;
+    return FALSE;
+  }
+  return TRUE;
+}
+
+
+// FillConsoleOutputCharacter & FillConsoleOutputAttribute, using the grid if
+// the cells are in the window.
+void fill_blank( DWORD len, COORD pos, WORD attr )
+{
+  GCELL blank;
+  DWORD written;
+
+  wait_writer();
+  if (grid_ready())
+  {
+    blank.ch   = ' ';
+    blank.attr = attr;
+    if (gr_fill( &grid, len, pos.X, pos.Y, &blank ))
+      return;
+    grid_sync();
+  }
+  FillConsoleOutputCharacter( hConOut, ' ', len, pos, &written );
+  FillConsoleOutputAttribute( hConOut, attr, len, pos, &written );
+}
+
+
+// ScrollConsoleScreenBuffer, using the grid if everything involved is in the
+// window.
+void scroll_buffer( const SMALL_RECT* rect, const SMALL_RECT* clip,
+		    COORD dest, const CHAR_INFO* fill )
+{
+  CONSOLE_SCREEN_BUFFER_INFO Info;
+  SMALL_RECT c;
+
+  wait_writer();
+  if (grid_ready())
+  {
+    get_info( &Info );
+    if (clip != NULL)
+      c = *clip;
+    else
+    {
+      c.Left = c.Top = 0;
+      c.Right  = RIGHT;
+      c.Bottom = LAST;
+    }
+    if (gr_scroll( &grid, (const GRECT*)rect, (const GRECT*)&c,
+		   dest.X, dest.Y, (const GCELL*)fill ))
+      return;
+    grid_sync();
+  }
+  ScrollConsoleScreenBuffer( hConOut, rect, clip, dest, fill );
+}
+
+
+// Put text in the grid, if it stays on the line and every character takes a
+// single cell.
+BOOL grid_text( LPCWSTR text, int len )
+{
+  CONSOLE_SCREEN_BUFFER_INFO Info;
+  int i, x;
+
+  if (im || !grid_ready())
+    return FALSE;
+  for (i = 0; i < len; ++i)
+    if (text[i] >= 0x7F && tx_cells( text[i], get_cells ) != 1)
+      return FALSE;
+  get_info( &Info );
+  x = gr_text( &grid, CUR.X, CUR.Y, (const unsigned short*)text, len,
+	       conmode & ENABLE_PROCESSED_OUTPUT, ATTR );
+  if (x < 0)
+    return FALSE;
+  CUR.X = x;
+  move_cursor( CUR );
+  return TRUE;
+}
+
+
+
+// Work out where writing the text from column x of a line width wide will take
+// the cursor (see tx_wrap), and the pending wrap after it.  Returns FALSE if it
+// can't be known (leave it to the console).
+BOOL predict_wrap( LPCWSTR text, int len, int x, int width,
+		   BOOL processed, BOOL wrap, BOOL vt, PCOORD pos, BOOL* pend )
+{
+  int y;
+
+  if (!tx_wrap( text, len, &x, width, processed, wrap, vt, get_cells, &y,
+		pend ))
+    return FALSE;
+  pos->X = x;
+  pos->Y = y;
+  return TRUE;
+}
+
+
+// Determine if text is only printable characters, each taking one cell.
+BOOL is_plain( LPCWSTR text, int len )
+{
+  return tx_plain( text, len, get_cells );
+}
+
+
+HANDLE hConWrap;		// scratch buffer for testing wrapping
+COORD  wrap_size;		// its size (X is 0 if it needs to be set)
+DWORD  wrap_mode;		// its mode
+
+DWORD stat_flush;		// times the buffer was written
+DWORD stat_wrap_create; 	// times the scratch buffer was created
+
+
+// Get the scratch buffer ready to write len characters from column x of the
+// top line.  It's kept between writes, only being resized when the width
+// changes or it needs more lines.
+void ready_scratch( int x, int len )
+{
+  CONSOLE_SCREEN_BUFFER_INFO Info;
+  CONSOLE_CURSOR_INFO cci;
+  COORD size, pos;
+  DWORD mode, written;
+  int	tries;
+
+  get_info( &Info );
+  size.X = WIDTH;
+  size.Y = 2 * len / WIDTH + 1;
+  if (size.Y < BOTTOM - TOP + 1)
+    size.Y = BOTTOM - TOP + 1;
+  pos.X = x;
+  pos.Y = 0;
+
+  for (tries = 0; tries < 2; ++tries)
+  {
+    if (hConWrap == NULL || tries)
+    {
+      if (hConWrap != NULL)
+	CloseHandle( hConWrap );
+      hConWrap = CreateConsoleScreenBuffer( GENERIC_READ|GENERIC_WRITE, 0,
+					    NULL, CONSOLE_TEXTMODE_BUFFER, NULL);
+      if (hConWrap == INVALID_HANDLE_VALUE)
+      {
+	hConWrap = NULL;
+	return;
+      }
+      ++stat_wrap_create;
+      // Even though the buffer isn't visible, the cursor still shows up.
+      cci.dwSize = 1;
+      cci.bVisible = FALSE;
+      SetConsoleCursorInfo( hConWrap, &cci );
+      wrap_size.X = 0;
+      wrap_mode = ~0;
+    }
+    // Ensure the buffer is the same width (it gets created using the window
+    // width) and contains sufficient lines.  It can't be made narrower than
+    // its window, nor does it exist if the console has changed, so just make
+    // another one.
+    if (wrap_size.X != size.X || wrap_size.Y < size.Y)
+    {
+      if (!SetConsoleScreenBufferSize( hConWrap, size ))
+	continue;
+      wrap_size = size;
+    }
+    if (SetConsoleCursorPosition( hConWrap, pos ))
+      break;
+  }
+
+  if (pState->crm)
+    mode = (awm) ? ENABLE_WRAP_AT_EOL_OUTPUT : 0;
+  else if (!awm)
+    mode = ENABLE_PROCESSED_OUTPUT;
+  else if (conmode & 4) // ENABLE_VIRTUAL_TERMINAL_PROCESSING
+  {
+    // Windows 10 1803 writes to the active buffer if VT is enabled.
+    mode = conmode & ~4;
+  }
+  else
+    mode = ENABLE_PROCESSED_OUTPUT | ENABLE_WRAP_AT_EOL_OUTPUT;
+  if (mode != wrap_mode)
+  {
+    SetConsoleMode( hConWrap, mode );
+    wrap_mode = mode;
+  }
+
+  // Lines are only copied from the buffer with margins, so only then does it
+  // need to be blank.
+  if (pState->tb_margins)
+  {
+    pos.X = pos.Y = 0;
+    FillConsoleOutputCharacter( hConWrap, ' ', size.X * size.Y, pos, &written );
+    FillConsoleOutputAttribute( hConWrap, ATTR, size.X * size.Y, pos, &written );
+    SetConsoleTextAttribute( hConWrap, ATTR );
+  }
+}
+
+
+// How many cells the console gives a non-ASCII character of each width (see
+// tx_cells), found by writing one to the scratch buffer whenever the code page
+// changes (which is checked once a write).  Double-byte code pages may use two
+// cells for what would otherwise be narrow (depending on the font), so those
+// are left to the console.
+int  cells[3] = { -1, -1, -1 };
+UINT cells_cp;
+BOOL cells_valid;		// the code page has been checked (this write)
+
+const int* get_cells( void )
+{
+  static const WCHAR probe[3][2] = { { 'a', 0x0301 }, { 0x00E9 }, { 0x4E00 } };
+  CONSOLE_SCREEN_BUFFER_INFO wi;
+  DWORD written;
+  UINT	cp;
+  int	w;
+
+  if (cells_valid)
+    return cells;
+  cells_valid = TRUE;
+  cp = GetConsoleOutputCP();
+  if (cp != cells_cp)
+  {
+    cells_cp = cp;
+    for (w = 0; w < 3; ++w)
+    {
+      cells[w] = -1;
+      if (w == 1 && is_dbcs_cp())
+	continue;
+      ready_scratch( 0, 2 );
+      if (hConWrap != NULL &&
+	  WriteConsole( hConWrap, probe[w], (w == 0) ? 2 : 1, &written, NULL ) &&
+	  GetConsoleScreenBufferInfo( hConWrap, &wi ) &&
+	  wi.dwCursorPosition.Y == 0)
+      {
+	cells[w] = wi.dwCursorPosition.X - (w == 0);
+	if (cells[w] > 2)
+	  cells[w] = -1;
+      }
+    }
+  }
+  return cells;
+}
+
+
+// Keep track of the pending wrap: the text has wrapped at the right margin and
+// nothing but spaces has been written since, so a newline is not needed.  X is
+// the column the text left the cursor and WRAPPED is if it wrapped to get there
+// (when it wasn't predicted, see tx_track_wrap).
+void track_wrap( LPCWSTR text, int len, int x, BOOL wrapped )
+{
+  wrap_pend = tx_track_wrap( text, len, x, wrapped, conmode & 4, wrap_pend );
+}
+
+
 //-----------------------------------------------------------------------------
-//   FlushBuffer()
-// Writes the buffer to the console and empties it.
+//   WriteText( LPCWSTR text, int len )
+// Writes the text to the console, keeping track of wrapping.
 //-----------------------------------------------------------------------------
 
-void FlushBuffer( void )
+void WriteText( LPCWSTR text, int len )
 {
   DWORD nWritten;
 
-  EnterCriticalSection( &CritSect );
+  wait_writer();
 
-  if (nCharInBuffer <= 0)
+  if (grid_text( text, len ))
   {
-    LeaveCriticalSection( &CritSect );
+    track_wrap( text, len, 0, FALSE );
     return;
   }
+  grid_sync();
+
+  apply_attr();
+  apply_pos();
 
   if ((wm || !awm) && !im && !pState->tb_margins)
   {
     if (pState->crm)
     {
-      SetConsoleMode( hConOut, cache[0].mode & ~ENABLE_PROCESSED_OUTPUT );
-      WriteConsole( hConOut, ChBuffer, nCharInBuffer, &nWritten, NULL );
-      SetConsoleMode( hConOut, cache[0].mode );
+      SetConsoleMode( hConOut, conmode & ~ENABLE_PROCESSED_OUTPUT );
+      WriteConsole( hConOut, text, len, &nWritten, NULL );
+      SetConsoleMode( hConOut, conmode );
     }
     else
-      WriteConsole( hConOut, ChBuffer, nCharInBuffer, &nWritten, NULL );
+      WriteConsole( hConOut, text, len, &nWritten, NULL );
   }
   else
   {
-    HANDLE hConWrap;
-    CONSOLE_CURSOR_INFO cci;
     CONSOLE_SCREEN_BUFFER_INFO Info, wi;
+    BOOL pend = wrap_pend, predicted;
 
-    if (nCharInBuffer < 4 && !im && !pState->tb_margins)
+    get_info( &Info );
+    if (len < 4 && !im && !pState->tb_margins)
     {
-      LPWSTR b = ChBuffer;
+      LPCWSTR b = text;
       if (pState->crm)
-	SetConsoleMode( hConOut, cache[0].mode & ~ENABLE_PROCESSED_OUTPUT );
-      do
+	SetConsoleMode( hConOut, conmode & ~ENABLE_PROCESSED_OUTPUT );
+      // VT processing delays the wrap, so only predict without it.
+      if (!(conmode & 4) &&
+	  predict_wrap( text, len, CUR.X, WIDTH, !pState->crm &&
+			(conmode & ENABLE_PROCESSED_OUTPUT), TRUE, FALSE,
+			&wi.CURPOS, &pend ))
+      {
+	++stat_wrap_predict;
+	WriteConsole( hConOut, text, len, &nWritten, NULL );
+	nWrapped += wi.CURPOS.Y;
+	wrap_pend = pend;
+      }
+      else
       {
-	WriteConsole( hConOut, b, 1, &nWritten, NULL );
-	if (pState->crm || (*b != '\r' && *b != '\b' && *b != '\a'))
+	++stat_wrap_test;
+	do
 	{
-	  GetConsoleScreenBufferInfo( hConOut, &Info );
-	  if (CUR.X == 0)
-	    ++nWrapped;
-	}
-      } while (++b, --nCharInBuffer);
+	  WriteConsole( hConOut, b, 1, &nWritten, NULL );
+	  csbi_valid = FALSE;
+	  if (pState->crm || (*b != '\r' && *b != '\b' && *b != '\a'))
+	  {
+	    get_info( &Info );
+	    if (CUR.X == 0)
+	    {
+	      ++nWrapped;
+	      wrap_pend = TRUE;
+	    }
+	    else if (*b != ' ')
+	      wrap_pend = FALSE;
+	  }
+	} while (++b, --len);
+      }
       if (pState->crm)
-	SetConsoleMode( hConOut, cache[0].mode );
+	SetConsoleMode( hConOut, conmode );
     }
     else
     {
-      // To detect wrapping of multiple characters, create a new buffer, write
-      // to the top of it and see if the cursor changes line.  This doesn't
-      // always work on the normal buffer, since if you're already on the last
-      // line, wrapping scrolls everything up and still leaves you on the last.
-      hConWrap = CreateConsoleScreenBuffer( GENERIC_READ|GENERIC_WRITE, 0, NULL,
-					    CONSOLE_TEXTMODE_BUFFER, NULL );
-      // Even though the buffer isn't visible, the cursor still shows up.
-      cci.dwSize = 1;
-      cci.bVisible = FALSE;
-      SetConsoleCursorInfo( hConWrap, &cci );
-      // Ensure the buffer is the same width (it gets created using the window
-      // width) and contains sufficient lines.
-      GetConsoleScreenBufferInfo( hConOut, &Info );
-      wi.dwSize.X = WIDTH;
-      wi.dwSize.Y = 0;
-      if (WIN.Right - WIN.Left + 1 != WIDTH)
-	wi.dwSize.Y = BOTTOM - TOP + 1;
-      if (BOTTOM - TOP < 2 * nCharInBuffer / WIDTH)
-	wi.dwSize.Y = 2 * nCharInBuffer / WIDTH + 1;
-      if (wi.dwSize.Y)
-	SetConsoleScreenBufferSize( hConWrap, wi.dwSize );
-      // Put the cursor on the top line, in the same column.
-      wi.CURPOS.X = CUR.X;
-      wi.CURPOS.Y = 0;
-      SetConsoleCursorPosition( hConWrap, wi.CURPOS );
-      if (pState->crm)
-	SetConsoleMode( hConWrap, (awm) ? ENABLE_WRAP_AT_EOL_OUTPUT : 0 );
-      else if (!awm)
-	SetConsoleMode( hConWrap, ENABLE_PROCESSED_OUTPUT );
-      else if (cache[0].mode & 4) // ENABLE_VIRTUAL_TERMINAL_PROCESSING
+      // See where the text would take the cursor (from the top line of a new
+      // buffer, as below).  If the scroll region is smaller than the text,
+      // the buffer is still needed to copy the lines that remain.
+      predicted = predict_wrap( text, len, CUR.X, WIDTH, !pState->crm &&
+				(!awm || (conmode & ENABLE_PROCESSED_OUTPUT)),
+				awm, conmode & 4, &wi.CURPOS, &pend );
+      if (predicted &&
+	  (!pState->tb_margins ||
+	   CUR.Y + wi.CURPOS.Y <= TOP + pState->bot_margin ||
+	   (CUR.Y <= TOP + pState->bot_margin &&
+	    wi.CURPOS.Y <= pState->bot_margin - pState->top_margin)))
       {
-	// Windows 10 1803 writes to the active buffer if VT is enabled.
-	SetConsoleMode( hConWrap, cache[0].mode & ~4 );
+	++stat_wrap_predict;
+      }
+      else
+      {
+	++stat_wrap_test;
+	// To detect wrapping of multiple characters, write to the top of a
+	// separate buffer and see if the cursor changes line.  This doesn't
+	// always work on the normal buffer, since if you're already on the last
+	// line, wrapping scrolls everything up and still leaves you on the last.
+	ready_scratch( CUR.X, len );
+	WriteConsole( hConWrap, text, len, &nWritten, NULL );
+	GetConsoleScreenBufferInfo( hConWrap, &wi );
       }
-      WriteConsole( hConWrap, ChBuffer, nCharInBuffer, &nWritten, NULL );
-      GetConsoleScreenBufferInfo( hConWrap, &wi );
       if (pState->tb_margins && CUR.Y + wi.CURPOS.Y > TOP + pState->bot_margin)
       {
 	if (CUR.Y > TOP + pState->bot_margin)
@@ -833,7 +1491,6 @@ void FlushBuffer( void )
 		  ++CUR.Y;
 	      }
 	      HeapFree( hHeap, 0, row );
-	      CloseHandle( hConWrap );
 	      nWrapped = 0;
 	      goto done;
 	    }
@@ -861,8 +1518,11 @@ void FlushBuffer( void )
 	    r.Bottom = TOP + pState->bot_margin;
 	    WriteConsoleOutput( hConOut, row, s, c, &r );
 	    HeapFree( hHeap, 0, row );
-	    CloseHandle( hConWrap );
 	    nWrapped = pState->bot_margin - pState->top_margin;
+	    if (predicted)
+	      wrap_pend = pend;
+	    else
+	      track_wrap( text, len, wi.CURPOS.X, TRUE );
 	    goto done;
 	  }
 	}
@@ -887,7 +1547,10 @@ void FlushBuffer( void )
 	}
       }
       nWrapped += wi.CURPOS.Y;
-      CloseHandle( hConWrap );
+      if (predicted)
+	wrap_pend = pend;
+      else
+	track_wrap( text, len, wi.CURPOS.X, wi.CURPOS.Y );
       if (im && !nWrapped)
       {
 	SMALL_RECT sr, cr;
@@ -921,95 +1584,443 @@ void FlushBuffer( void )
       }
       if (pState->crm)
       {
-	SetConsoleMode( hConOut, cache[0].mode & ~ENABLE_PROCESSED_OUTPUT );
-	WriteConsole( hConOut, ChBuffer, nCharInBuffer, &nWritten, NULL );
-	SetConsoleMode( hConOut, cache[0].mode );
+	SetConsoleMode( hConOut, conmode & ~ENABLE_PROCESSED_OUTPUT );
+	WriteConsole( hConOut, text, len, &nWritten, NULL );
+	SetConsoleMode( hConOut, conmode );
       }
       else
-	WriteConsole( hConOut, ChBuffer, nCharInBuffer, &nWritten, NULL );
+	WriteConsole( hConOut, text, len, &nWritten, NULL );
     }
   }
-done:
-  nCharInBuffer = 0;
 
-  LeaveCriticalSection( &CritSect );
+done:
+  // Writing moves the cursor and may scroll the window.
+  csbi_valid = FALSE;
 }
 
 //-----------------------------------------------------------------------------
-//   PushBuffer( WCHAR c )
-// Adds a character in the buffer.
+//   FlushBuffer()
+// Writes the buffer to the console and empties it.
 //-----------------------------------------------------------------------------
 
-void PushBuffer( WCHAR c )
+void FlushBuffer( void )
+{
+  EnterCriticalSection( &CritSect );
+
+  wait_writer();
+
+  if (nCharInBuffer > 0)
+  {
+    if (hPending != hConOut)
+    {
+      // The text belongs to another handle, which has since been replaced (by
+      // one that hasn't written anything yet).  Make it current while writing
+      // (IsConsoleHandle makes its mode current).  Anything pending
+      // belongs to the current handle, so keep it out of the way.
+      HANDLE h = hConOut;
+      int   attr = pending_attr;
+      BOOL  move = pending_move;
+      pending_attr = -1;
+      pending_move = FALSE;
+      hConOut = hPending;
+      csbi_valid = FALSE;
+      IsConsoleHandle( hConOut );
+      if (nLinesInBuffer)
+	write_lines( ChBuffer, nCharInBuffer );
+      else
+	WriteText( ChBuffer, nCharInBuffer );
+      hConOut = h;
+      csbi_valid = FALSE;
+      IsConsoleHandle( hConOut );
+      pending_attr = attr;
+      pending_move = move;
+    }
+    else if (nLinesInBuffer)
+      write_lines( ChBuffer, nCharInBuffer );
+    else
+      WriteText( ChBuffer, nCharInBuffer );
+    if ((DWORD)nCharInBuffer > stat_flush_len)
+      stat_flush_len = nCharInBuffer;
+    nCharInBuffer = nLinesInBuffer = 0;
+    ++stat_flush;
+    ++stat_flush_why[flush_why];
+  }
+  flush_why = FR_SEQ;
+
+  LeaveCriticalSection( &CritSect );
+}
+
+//-----------------------------------------------------------------------------
+//   FlushConsole()
+// Writes the buffer and sets anything else pending, before the program itself
+// accesses the console.
+//-----------------------------------------------------------------------------
+
+void FlushConsole( void )
+{
+  EnterCriticalSection( &CritSect );
+  if (flush_why == FR_SEQ)
+    flush_why = FR_HOOK;
+  FlushBuffer();
+  grid_sync();
+  apply_attr();
+  apply_pos();
+  csbi_valid = FALSE;
+  LeaveCriticalSection( &CritSect );
+}
+
+//-----------------------------------------------------------------------------
+//   QueueBuffer()
+// Writes the buffer in the background, filling the other one meanwhile.  This
+// is only done when nothing but WriteConsole remains (everything else is done
+// here, first).  Returns FALSE if it has to be written directly.
+//-----------------------------------------------------------------------------
+
+DWORD WINAPI WriterThread( LPVOID param )
+{
+  DWORD written;
+
+  for (;;)
+  {
+    WaitForSingleObject( hWriteStart, INFINITE );
+    WriteConsole( hWriteCon, WriteBuf, nWriteLen, &written, NULL );
+    SetEvent( hWriteDone );
+  }
+}
+
+BOOL QueueBuffer( void )
+{
+  CONSOLE_SCREEN_BUFFER_INFO Info;
+  COORD pos;
+  BOOL	pend;
+  int	size;
+
+  if (nCharInBuffer == 0 || nLinesInBuffer ||
+      hWriteStart == NULL || hWriteDone == NULL || hPending != hConOut ||
+      gm || im || pState->crm || pState->tb_margins)
+    return FALSE;
+
+  if (!get_info( &Info ))	// also waits for the previous write
+    return FALSE;
+  pos.Y = 0;
+  if (!wm && awm)
+  {
+    // Wrapping has to be known (as WriteText would do it, without needing
+    // the scroll it does to use the default attribute).
+    pend = wrap_pend;
+    if ((nCharInBuffer < 4 && (conmode & 4)) ||
+	!predict_wrap( ChBuffer, nCharInBuffer, CUR.X, WIDTH,
+		       conmode & ENABLE_PROCESSED_OUTPUT, TRUE, conmode & 4,
+		       &pos, &pend ) ||
+	(nWrapped + pos.Y && CUR.Y + nWrapped + pos.Y > LAST))
+      return FALSE;
+  }
+
+  if (hWriter == NULL)
+  {
+    hWriter = CreateThread( NULL, 4096, WriterThread, NULL, 0, NULL );
+    if (hWriter == NULL)
+      return FALSE;
+  }
+
+  apply_attr();
+  apply_pos();
+  nWrapped += pos.Y;
+  if (!wm && awm)
+    wrap_pend = pend;
+  else
+    track_wrap( ChBuffer, nCharInBuffer, pos.X, pos.Y );
+  hWriteCon = hConOut;
+  WriteBuf  = ChBuffer;
+  nWriteLen = nCharInBuffer;
+  ChBuffer  = ChSpare;
+  ChSpare   = (LPWSTR)WriteBuf;
+  size	    = nBufferSize;
+  nBufferSize = nSpareSize;
+  nSpareSize  = size;
+  if ((DWORD)nCharInBuffer > stat_flush_len)
+    stat_flush_len = nCharInBuffer;
+  nCharInBuffer = 0;
+  csbi_valid = FALSE;
+  ++stat_flush;
+  ++stat_flush_why[flush_why];
+  flush_why = FR_SEQ;
+  ++stat_write_queued;
+  writing = TRUE;
+  SetEvent( hWriteStart );
+  return TRUE;
+}
+
+// Flush the buffer if it belongs to another handle, then take it.
+void claim_buffer( void )
+{
+  if (hPending != hConOut)
+  {
+    FlushBuffer();
+    hPending = hConOut;
+  }
+}
+
+// The buffer starts small, for interactive use, and grows to collect larger
+// output, to write it all at once.  The initial buffers are static; larger
+// ones come from the heap.
+#define IS_STATIC( buf ) ((buf) == ChBuffers[0] || (buf) == ChBuffers[1])
+
+// Make the buffer bigger, returning FALSE if it can't be.
+BOOL grow_buffer( void )
+{
+  LPWSTR buf;
+  int	 size;
+
+  if (nBufferSize >= nBufferMax)
+    return FALSE;
+  size = 2 * nBufferSize;
+  if (size > nBufferMax)
+    size = nBufferMax;
+  if (IS_STATIC( ChBuffer ))
+  {
+    buf = HeapAlloc( hHeap, 0, TSIZE(size) );
+    if (buf != NULL)
+      RtlMoveMemory( buf, ChBuffer, TSIZE(nCharInBuffer) );
+  }
+  else
+    buf = HeapReAlloc( hHeap, 0, ChBuffer, TSIZE(size) );
+  if (buf == NULL)
+    return FALSE;
+
+  ChBuffer = buf;
+  nBufferSize = size;
+  ++stat_buffer_grow;
+  return TRUE;
+}
+
+// Go back to the initial buffers once they're empty.
+void shrink_buffers( void )
+{
+  if (nCharInBuffer != 0 || writing ||
+      (IS_STATIC( ChBuffer ) && IS_STATIC( ChSpare )))
+    return;
+
+  if (!IS_STATIC( ChBuffer ))
+    HeapFree( hHeap, 0, ChBuffer );
+  if (!IS_STATIC( ChSpare ))
+    HeapFree( hHeap, 0, ChSpare );
+  ChBuffer = ChBuffers[0];
+  ChSpare  = ChBuffers[1];
+  nBufferSize = nSpareSize = BUFFER_SIZE;
+}
+
+// Write the full buffer, unless it can be made bigger.
+void flush_full( void )
+{
+  if (grow_buffer())
+    return;
+  flush_why = FR_FULL;
+  if (!QueueBuffer())
+    FlushBuffer();
+}
+
+// Write the buffer ending with CR, moving back up if it wrapped.
+void flush_cr( void )
+{
+  CONSOLE_SCREEN_BUFFER_INFO Info;
+
+  FlushBuffer();
+  if (nWrapped)
+  {
+    get_info( &Info );
+    CUR.Y -= nWrapped;
+    if (CUR.Y < 0) CUR.Y = 0;
+    if (pState->tb_margins && CUR.Y < TOP) CUR.Y = TOP;
+    set_pos( LEFT, CUR.Y );
+  }
+}
+
+//-----------------------------------------------------------------------------
+//   new_line()
+// Moves to the next line for LF, unless the text has just wrapped to it.
+//-----------------------------------------------------------------------------
+
+void new_line( void )
+{
+  CONSOLE_SCREEN_BUFFER_INFO Info;
+  BOOL nl = TRUE;
+
+  if (nWrapped)
+  {
+    // It's wrapped, but was anything more written?  If it was just spaces
+    // they can be ignored and overwritten.
+    if (wrap_pend)
+    {
+      get_info( &Info );
+      if (CUR.X != 0)
+      {
+	CUR.X = 0;
+	move_cursor( CUR );
+      }
+      nl = FALSE;
+    }
+    nWrapped = 0;
+  }
+  if (nl)
+    MoveDown( TRUE, 1 );
+}
+
+//-----------------------------------------------------------------------------
+//   write_lines( LPCWSTR text, int len )
+// Writes text containing newlines (jump scroll).  The lines are counted first,
+// so whatever scrolls does so all at once; each line is then written where it
+// ends up, with those that would scroll off the top not written at all.  If a
+// line can't be counted, the lines are written one at a time, as usual.
+//-----------------------------------------------------------------------------
+
+void write_lines( LPCWSTR text, int len )
+{
+  CONSOLE_SCREEN_BUFFER_INFO Info;
+  LPCWSTR end = text + len, p, eol;
+  TXLINE  line;
+  int	  x, y, rows, scroll;
+
+  get_info( &Info );
+
+  // Count the rows taken by the lines (see tx_jump_rows).
+  rows = tx_jump_rows( text, len, CUR.X, WIDTH, get_cells );
+  if (rows < 0)
+    goto one_at_a_time;
+
+  // Scroll everything that needs it.
+  scroll = CUR.Y + rows - LAST;
+  if (scroll > 0)
+  {
+    scroll_lines( 0, LAST, scroll );
+    ++stat_jump;
+    stat_jump_lines += scroll;
+  }
+  else
+    scroll = 0;
+
+  // Write each line where it now starts.
+  x = CUR.X;
+  y = CUR.Y - scroll;
+  for (p = text; (eol = tx_next_line( p, end, &x, &y, WIDTH, &line )) != NULL;
+       p = eol)
+  {
+    if (line.len > 0)
+    {
+      set_pos( line.x, line.y );
+      WriteText( line.text, line.len );
+    }
+  }
+  set_pos( 0, y );
+  if (p < end)
+    WriteText( p, (int)(end - p) );
+  return;
+
+one_at_a_time:
+  for (p = text;; p = eol + 1)
+  {
+    for (eol = p; eol < end && *eol != '\n'; ++eol) ;
+    if (eol > p)
+      WriteText( p, (int)(eol - p) );
+    if (eol == end)
+      break;
+    new_line();
+  }
+}
+
+// Progress indicators rewrite a line (using CR) many times between flushes.
+// Rather than write each one, put the new text over the buffered line (adding
+// CR and the text again if it's shorter, to leave the cursor after it).  This
+// is only done for plain text that starts at the left margin and doesn't reach
+// the right.  Returns FALSE if it can't be done.
+BOOL coalesce_cr( LPCWSTR s, DWORD len )
+{
+  CONSOLE_SCREEN_BUFFER_INFO Info;
+  int beg, cr, end, n;
+
+  if (sm || im || shifted)
+    return FALSE;
+
+  // Find the start of the line, which may already be followed by CR and
+  // previous text (that being its beginning), then the final CR.
+  get_info( &Info );
+  end = nCharInBuffer - 1;
+  cr = end;
+  for (beg = end; beg > 0 && ChBuffer[beg-1] != '\n'; --beg)
+  {
+    if (ChBuffer[beg-1] == '\r')
+    {
+      if (cr != end)
+	return FALSE;
+      cr = beg - 1;
+    }
+    if (end - beg > 2 * WIDTH)
+      return FALSE;
+  }
+  if (beg == 0 && (CUR.X != 0 || nWrapped))
+    return FALSE;
+  n = cr - beg;
+  if (n >= WIDTH || (int)len >= WIDTH || beg + n + 1 + (int)len >= nBufferSize ||
+      !is_plain( ChBuffer + beg, n ) || !is_plain( s, len ))
+    return FALSE;
+
+  RtlMoveMemory( ChBuffer + beg, s, TSIZE(len) );
+  if ((int)len >= n)
+    nCharInBuffer = beg + len;
+  else
+  {
+    ChBuffer[beg + n] = '\r';
+    RtlMoveMemory( ChBuffer + beg + n + 1, s, TSIZE(len) );
+    nCharInBuffer = beg + n + 1 + len;
+  }
+  ++stat_cr_coalesce;
+  return TRUE;
+}
+
+//-----------------------------------------------------------------------------
+//   PushBuffer( WCHAR c )
+// Adds a character in the buffer.
+//-----------------------------------------------------------------------------
+
+void PushBuffer( WCHAR c )
 {
   CONSOLE_SCREEN_BUFFER_INFO Info;
 
+  claim_buffer();
   ChPrev = c;
 
   if (c == '\n')
   {
+    // Jump scroll: keep the line, so all the lines can be scrolled at once.
+    if (!sm && !wm && awm && !im && !gm && !pState->crm &&
+	!pState->tb_margins && nWrapped == 0)
+    {
+      ChBuffer[nCharInBuffer] = c;
+      ++nLinesInBuffer;
+      if (++nCharInBuffer == nBufferSize)
+	flush_full();
+      return;
+    }
     if (pState->crm)
       ChBuffer[nCharInBuffer++] = c;
+    flush_why = FR_NEWLINE;
     FlushBuffer();
     if (wm)
     {
-      MoveDown( TRUE );
+      MoveDown( TRUE, 1 );
       return;
     }
     // Avoid writing the newline if wrap has already occurred.
-    GetConsoleScreenBufferInfo( hConOut, &Info );
     if (pState->crm)
     {
       // If we're displaying controls, then the only way we can be on the left
       // margin is if wrap occurred.
+      get_info( &Info );
       if (CUR.X != 0)
-	MoveDown( TRUE );
+	MoveDown( TRUE, 1 );
     }
     else
-    {
-      BOOL nl = TRUE;
-      if (nWrapped)
-      {
-	// It's wrapped, but was anything more written?  Look at the current
-	// row, checking that each character is space in current attributes.
-	// If it's all blank we can drop the newline.  If the cursor isn't
-	// already at the margin, then it was spaces or tabs that caused the
-	// wrap, which can be ignored and overwritten.
-	CHAR_INFO blank;
-	PCHAR_INFO row = HeapAlloc( hHeap, 0, WIDTH * sizeof(CHAR_INFO) );
-	if (row != NULL)
-	{
-	  COORD s, c;
-	  SMALL_RECT r;
-	  s.X = WIDTH;
-	  s.Y = 1;
-	  c.X = c.Y = 0;
-	  r.Left = LEFT;
-	  r.Right = RIGHT;
-	  r.Top = r.Bottom = CUR.Y;
-	  ReadConsoleOutput( hConOut, row, s, c, &r );
-	  blank.Char.UnicodeChar = ' ';
-	  blank.Attributes = ATTR;
-	  while (*(PDWORD)&row[c.X] == *(PDWORD)&blank)
-	  {
-	    if (++c.X == s.X)
-	    {
-	      if (CUR.X != 0)
-	      {
-		CUR.X = 0;
-		SetConsoleCursorPos( hConOut, CUR );
-	      }
-	      nl = FALSE;
-	      break;
-	    }
-	  }
-	  HeapFree( hHeap, 0, row );
-	}
-	nWrapped = 0;
-      }
-      if (nl)
-	MoveDown( TRUE );
-    }
+      new_line();
     return;
   }
   if (!pState->crm)
@@ -1017,28 +2028,21 @@ void PushBuffer( WCHAR c )
     if (nCharInBuffer > 0 && ChBuffer[nCharInBuffer-1] == '\r')
     {
       if (c == '\r') return; // \r\r\r... == \r, thus \r\r\n == \r\n
-      FlushBuffer();
-      if (nWrapped)
-      {
-	GetConsoleScreenBufferInfo( hConOut, &Info );
-	CUR.Y -= nWrapped;
-	if (CUR.Y < 0) CUR.Y = 0;
-	if (pState->tb_margins && CUR.Y < TOP) CUR.Y = TOP;
-	set_pos( LEFT, CUR.Y );
-      }
+      flush_cr();
     }
     if (c == '\b')
     {
       FlushBuffer();
       if (nWrapped)
       {
-	GetConsoleScreenBufferInfo( hConOut, &Info );
+	get_info( &Info );
 	if (CUR.X == LEFT)
 	{
 	  CUR.X = RIGHT;
 	  CUR.Y--;
-	  SetConsoleCursorPos( hConOut, CUR );
+	  move_cursor( CUR );
 	  --nWrapped;
+	  wrap_pend = FALSE;
 	  return;
 	}
       }
@@ -1047,8 +2051,64 @@ void PushBuffer( WCHAR c )
   if (shifted && c >= FIRST_G1 && c <= LAST_G1)
     c = G1[c-FIRST_G1];
   ChBuffer[nCharInBuffer] = c;
-  if (++nCharInBuffer == BUFFER_SIZE)
-    FlushBuffer();
+  if (++nCharInBuffer == nBufferSize)
+    flush_full();
+}
+
+//-----------------------------------------------------------------------------
+//   PushRun( LPCWSTR s, DWORD len )
+// Adds a run of characters (without controls) in the buffer.
+//-----------------------------------------------------------------------------
+
+void PushRun( LPCWSTR s, DWORD len )
+{
+  DWORD n, j;
+
+  claim_buffer();
+  ChPrev = s[len-1];
+
+  if (!pState->crm && nCharInBuffer > 0 && ChBuffer[nCharInBuffer-1] == '\r')
+  {
+    if (coalesce_cr( s, len ))
+      return;
+    flush_cr();
+  }
+
+  // A run that would fill the buffer anyway is written directly (the wrap
+  // buffer is limited to DIRECT_MAX, to keep its size reasonable).
+  if (nCharInBuffer == 0 && !shifted)
+  {
+    while (len >= (DWORD)nBufferMax)
+    {
+      n = (len > DIRECT_MAX) ? DIRECT_MAX : len;
+      WriteText( s, n );
+      s += n;
+      len -= n;
+    }
+  }
+
+  while (len > 0)
+  {
+    n = nBufferSize - nCharInBuffer;
+    if (n > len) n = len;
+    if (shifted)
+    {
+      for (j = 0; j < n; ++j)
+      {
+	WCHAR c = s[j];
+	if (c >= FIRST_G1 && c <= LAST_G1)
+	  c = G1[c-FIRST_G1];
+	ChBuffer[nCharInBuffer+j] = c;
+      }
+    }
+    else
+      RtlMoveMemory( ChBuffer + nCharInBuffer, s, TSIZE(n) );
+    nCharInBuffer += n;
+    s += n;
+    len -= n;
+    if (nCharInBuffer == nBufferSize)
+      flush_full();
+  }
 }
 
 //-----------------------------------------------------------------------------
@@ -1121,17 +2181,70 @@ int color_distance( COLORREF c1, COLORREF c2 )
 	 (((767 - rmean) * b * b) >> 8);
 }
 
-// Find the nearest color to a system color.
-int find_nearest_color( COLORREF col )
+// Nearest colors are remembered, since finding them means getting the palette
+// and comparing against all of it.  The palette is checked once per write (it
+// could have been changed by anything), forgetting them if it's different.
+COLORREF nearest_pal[16] = { CLR_INVALID }; // palette they're nearest in
+BOOL	 nearest_valid; 	// palette has been checked
+
+typedef struct
+{
+  COLORREF col;
+  int	   idx;
+} NEAREST;
+
+NEAREST nearest_rgb[256];	// by hash of the color
+NEAREST nearest_x[240]; 	// by xterm index (less the system colors)
+
+// ANSICON_NEAREST=oklab measures the distance in the Oklab color space (see
+// oklab.h).
+BOOL oklab;			// use Oklab, rather than "redmean"
+int  pal_lab[16][3];		// the palette in Oklab
+BYTE oklab_cube[32*32*32];	// nearest color (plus one) of each block
+
+void check_palette( void )
 {
-  int d, d_min;
-  int i, idx;
   CONSOLE_SCREEN_BUFFER_INFOX csbix;
   const COLORREF* table;
+  int i;
 
   csbix.cbSize = sizeof(csbix);
   table = (GetConsoleScreenBufferInfoX( hConOut, &csbix ))
 	  ? csbix.ColorTable : legacy_palette;
+  for (i = 0; i < 16 && table[i] == nearest_pal[i]; ++i) ;
+  if (i < 16)
+  {
+    RtlMoveMemory( nearest_pal, table, sizeof(nearest_pal) );
+    RtlFillMemory( nearest_rgb, sizeof(nearest_rgb), 0xFF );
+    RtlFillMemory( nearest_x, sizeof(nearest_x), 0xFF );
+    if (oklab)
+    {
+      for (i = 0; i < 16; ++i)
+	ok_lab( GetRValue( table[i] ), GetGValue( table[i] ),
+		GetBValue( table[i] ), pal_lab[i] );
+      RtlZeroMemory( oklab_cube, sizeof(oklab_cube) );
+    }
+    ++stat_palette;
+  }
+  nearest_valid = TRUE;
+}
+
+// Find the nearest color to a system color.
+int find_nearest_color( COLORREF col )
+{
+  int d, d_min;
+  int i, idx;
+  const COLORREF* table = nearest_pal;
+
+  if (oklab)
+  {
+    // The middle of a block could be nearer another color than the one in it.
+    for (i = 0; i < 16; ++i)
+      if (table[i] == col)
+	return i;
+    return ok_nearest( oklab_cube, pal_lab,
+		       GetRValue( col ), GetGValue( col ), GetBValue( col ) );
+  }
 
   d_min = color_distance( col, table[0] );
   if (d_min == 0) return 0;
@@ -1150,6 +2263,27 @@ int find_nearest_color( COLORREF col )
   return idx;
 }
 
+// Find the nearest color, remembering it.  X is the xterm index (less 16) the
+// color came from, or -1 if it's RGB.  The color of an index could be changed
+// (by another process), so it's always compared.
+int nearest_color( COLORREF col, int x )
+{
+  NEAREST* n;
+
+  if (!nearest_valid)
+    check_palette();
+  n = (x >= 0) ? &nearest_x[x] : &nearest_rgb[(col * 0x9E3779B1) >> 24];
+  if (n->col == col)
+    ++stat_color_hit;
+  else
+  {
+    ++stat_color_miss;
+    n->col = col;
+    n->idx = find_nearest_color( col );
+  }
+  return n->idx;
+}
+
 
 // ========== Reset
 
@@ -1160,6 +2294,7 @@ void Reset( BOOL hard )
   CONSOLE_CURSOR_INFO CursInfo;
   CONSOLE_SCREEN_BUFFER_INFOX csbix;
 
+  wait_writer();
   GetConsoleCursorInfo( hConOut, &CursInfo );
   CursInfo.bVisible = TRUE;
   SetConsoleCursorInfo( hConOut, &CursInfo );
@@ -1168,7 +2303,7 @@ void Reset( BOOL hard )
   pState->crm =
   pState->tb_margins = FALSE;
   awm = TRUE;
-  SetConsoleMode( hConOut, cache[0].mode | ENABLE_WRAP_AT_EOL_OUTPUT );
+  SetConsoleMode( hConOut, conmode | ENABLE_WRAP_AT_EOL_OUTPUT );
   shifted = G0_special = SaveG0 = FALSE;
   pState->SavePos.X = pState->SavePos.Y = 0;
   pState->SaveAttr = 0;
@@ -1195,6 +2330,8 @@ void Reset( BOOL hard )
       ++csbix.srWindow.Right;
       ++csbix.srWindow.Bottom;
       SetConsoleScreenBufferInfoX( hConOut, &csbix );
+      csbi_valid = FALSE;
+      nearest_valid = FALSE;
     }
     arrcpy( pState->x_palette, xterm_palette );
   }
@@ -1224,16 +2361,16 @@ void InterpretEscSeq( void )
   WORD attribut;
   CONSOLE_SCREEN_BUFFER_INFO Info;
   CONSOLE_CURSOR_INFO CursInfo;
-  DWORD len, NumberOfCharsWritten;
+  DWORD len;
   COORD Pos;
   SMALL_RECT Rect;
   CHAR_INFO  CharInfo;
   DWORD      mode;
   SHORT      top, bottom;
 
-#define FillBlank( len, Pos ) \
-  FillConsoleOutputCharacter( hConOut, ' ', len, Pos, &NumberOfCharsWritten );\
-  FillConsoleOutputAttribute( hConOut, ATTR, len, Pos, &NumberOfCharsWritten )
+#define FillBlank( len, Pos ) fill_blank( len, Pos, ATTR )
+
+  wait_writer();
 
   if (prefix == '[')
   {
@@ -1252,7 +2389,7 @@ void InterpretEscSeq( void )
 
 	    case 7: // DECAWM
 	      awm = (suffix == 'h');
-	      mode = cache[0].mode;
+	      mode = conmode;
 	      if (awm)
 		mode |= ENABLE_WRAP_AT_EOL_OUTPUT;
 	      else
@@ -1260,6 +2397,10 @@ void InterpretEscSeq( void )
 	      SetConsoleMode( hConOut, mode );
 	    break;
 
+	    case 4: // DECSCLM
+	      sm = (suffix == 'h');
+	    break;
+
 	    case 6: // DECOM
 	      pState->om = (suffix == 'h');
 	    break;
@@ -1278,7 +2419,10 @@ void InterpretEscSeq( void )
 	      buf.X = (suffix == 'l') ? pState->buf_width : 132;
 	      if (buf.X != 0)
 	      {
-		GetConsoleScreenBufferInfo( hConOut, &Info );
+		// Resizing may move the cursor, so put it where it should be.
+		grid_sync();
+		apply_pos();
+		get_info( &Info );
 		buf.Y = HEIGHT;
 		win.Left = LEFT;
 		win.Top = TOP;
@@ -1306,6 +2450,7 @@ void InterpretEscSeq( void )
 		  SetConsoleScreenBufferSize( hConOut, buf );
 		  SetConsoleWindowInfo( hConOut, TRUE, &win );
 		}
+		csbi_valid = FALSE;
 	      }
 	      // Even if the screen is not cleared, scroll in a new window the
 	      // first time this is used.
@@ -1338,7 +2483,7 @@ void InterpretEscSeq( void )
     p1 = (es_argv[0] == 0) ? 1 : es_argv[0];
     p2 = (es_argv[1] == 0) ? 1 : es_argv[1];
 
-    GetConsoleScreenBufferInfo( hConOut, &Info );
+    get_info( &Info );
     if (suffix2 == '+')
     {
       top    = 0;
@@ -1385,7 +2530,7 @@ void InterpretEscSeq( void )
 	    if (++i < es_argc)
 	    {
 	      COLORREF col = CLR_INVALID;
-	      int idx = -1;
+	      int idx = -1, x = -1;
 	      int arg = es_argv[i-1];
 
 	      if (es_argv[i] == 2)		// rgb
@@ -1401,11 +2546,14 @@ void InterpretEscSeq( void )
 		  if (es_argv[i] < 16)
 		    idx = es_argv[i];
 		  else if (es_argv[i] < 256)
-		    col = pState->x_palette[es_argv[i] - 16];
+		  {
+		    x = es_argv[i] - 16;
+		    col = pState->x_palette[x];
+		  }
 		}
 	      }
 	      if (col != CLR_INVALID)
-		idx = attr2ansi[find_nearest_color( col )];
+		idx = attr2ansi[nearest_color( col, x )];
 	      if (idx != -1)
 	      {
 		if (arg == 38)
@@ -1501,7 +2649,7 @@ void InterpretEscSeq( void )
 		   | backgroundcolor[pState->sgr.background] | u;
 	if (pState->sgr.reverse)
 	  attribut = ((attribut >> 4) & 15) | ((attribut & 15) << 4);
-	SetConsoleTextAttribute( hConOut, attribut );
+	set_attr( attribut );
       }
       return;
 
@@ -1544,9 +2692,10 @@ void InterpretEscSeq( void )
 		Pos.X = Pos.Y = 0;
 		CharInfo.Char.UnicodeChar = ' ';
 		CharInfo.Attributes = ATTR;
-		ScrollConsoleScreenBuffer(hConOut, &Rect, NULL, Pos, &CharInfo);
+		scroll_buffer( &Rect, NULL, Pos, &CharInfo );
 	      }
 	      SetConsoleWindowInfo( hConOut, TRUE, &WIN );
+	      csbi_valid = FALSE;
 	      screen_top = TOP;
 	      top = TOP;
 	      bottom = BOTTOM;
@@ -1626,7 +2775,7 @@ void InterpretEscSeq( void )
 	Pos.Y = Rect.Top + (suffix == 'T' ? p1 : -p1);
 	CharInfo.Char.UnicodeChar = ' ';
 	CharInfo.Attributes = get_default_attr( TRUE );
-	ScrollConsoleScreenBuffer( hConOut, &Rect, &Rect, Pos, &CharInfo );
+	scroll_buffer( &Rect, &Rect, Pos, &CharInfo );
       return;
 
       case 'L': // IL - ESC[#L Insert # blank lines.
@@ -1649,7 +2798,7 @@ void InterpretEscSeq( void )
 	Pos.Y = Rect.Top + (suffix == 'L' ? p1 : -p1);
 	CharInfo.Char.UnicodeChar = ' ';
 	CharInfo.Attributes = ATTR;
-	ScrollConsoleScreenBuffer( hConOut, &Rect, &Rect, Pos, &CharInfo );
+	scroll_buffer( &Rect, &Rect, Pos, &CharInfo );
 	// Technically should home the cursor, but perhaps not expected.
       return;
 
@@ -1666,7 +2815,7 @@ void InterpretEscSeq( void )
 	  CUR.X -= p1;
 	CharInfo.Char.UnicodeChar = ' ';
 	CharInfo.Attributes = ATTR;
-	ScrollConsoleScreenBuffer( hConOut, &Rect, &Rect, CUR, &CharInfo );
+	scroll_buffer( &Rect, &Rect, CUR, &CharInfo );
       return;
 
       case 'k': // VPB - ESC[#k
@@ -1775,7 +2924,7 @@ void InterpretEscSeq( void )
 	  Pos.X = (CUR.X & -8) + p1 * 8;
 	if (Pos.X > RIGHT) Pos.X = RIGHT;
 	// Don't use set_pos, the tabs could be discarded.
-	SetConsoleCursorPos( hConOut, Pos );
+	move_cursor( Pos );
       return;
 
       case 'Z': // CBT - ESC[#Z Moves cursor back # tabs
@@ -2128,120 +3277,152 @@ void InterpretEscSeq( void )
 	++csbix.srWindow.Right;
 	++csbix.srWindow.Bottom;
 	SetConsoleScreenBufferInfoX( hConOut, &csbix );
+	csbi_valid = FALSE;
+	nearest_valid = FALSE;
       }
     }
   }
 }
 
 
-void MoveDown( BOOL home )
+// Scroll lines top to bottom by n (up if positive, down if negative), filling
+// with the default attribute (see sc_scroll).
+void scroll_lines( int top, int bottom, int n )
 {
   CONSOLE_SCREEN_BUFFER_INFO Info;
   SMALL_RECT Rect;
   COORD      Pos;
   CHAR_INFO  CharInfo;
-
-  GetConsoleScreenBufferInfo( hConOut, &Info );
-  if (pState->tb_margins && CUR.Y == TOP + pState->bot_margin)
-  {
-    Rect.Left = LEFT;
-    Rect.Right = RIGHT;
-    Rect.Top = TOP + pState->top_margin + 1;
-    Rect.Bottom = TOP + pState->bot_margin;
-    Pos.X = LEFT;
-    Pos.Y = TOP + pState->top_margin;
-    CharInfo.Char.UnicodeChar = ' ';
-    CharInfo.Attributes = get_default_attr( TRUE );
-    ScrollConsoleScreenBuffer( hConOut, &Rect, NULL, Pos, &CharInfo );
-    if (home)
-    {
-      CUR.X = 0;
-      SetConsoleCursorPos( hConOut, CUR );
-    }
-  }
-  else if (pState->tb_margins && CUR.Y == BOTTOM)
-  {
-    if (home)
-    {
-      CUR.X = 0;
-      SetConsoleCursorPos( hConOut, CUR );
-    }
-  }
-  else if (CUR.Y == LAST)
+  SCSCROLL   sc;
+
+  get_info( &Info );
+  CharInfo.Char.UnicodeChar = ' ';
+  CharInfo.Attributes = get_default_attr( TRUE );
+  sc_scroll( top, bottom, n, &sc );
+  Pos.X = LEFT;
+  if (sc.from <= sc.to)
   {
     Rect.Left = LEFT;
     Rect.Right = RIGHT;
-    Rect.Top = 1;
-    Rect.Bottom = LAST;
-    Pos.X = Pos.Y = 0;
-    CharInfo.Char.UnicodeChar = ' ';
-    CharInfo.Attributes = get_default_attr( TRUE );
-    ScrollConsoleScreenBuffer( hConOut, &Rect, NULL, Pos, &CharInfo );
-    if (home)
-    {
-      CUR.X = 0;
-      SetConsoleCursorPos( hConOut, CUR );
-    }
+    Rect.Top = sc.from;
+    Rect.Bottom = sc.to;
+    Pos.Y = sc.dest;
+    scroll_buffer( &Rect, NULL, Pos, &CharInfo );
   }
-  else
+  if (sc.count > 0)
   {
-    if (home) CUR.X = 0;
-    ++CUR.Y;
-    SetConsoleCursorPos( hConOut, CUR );
+    Pos.Y = sc.clear;
+    fill_blank( sc.count * WIDTH, Pos, CharInfo.Attributes );
   }
 }
 
-void MoveUp( void )
+
+// The rows moving the cursor depends on.
+void get_area( SCAREA* a )
 {
   CONSOLE_SCREEN_BUFFER_INFO Info;
-  SMALL_RECT Rect;
-  COORD      Pos;
-  CHAR_INFO  CharInfo;
 
-  GetConsoleScreenBufferInfo( hConOut, &Info );
-  if (pState->tb_margins && CUR.Y == TOP + pState->top_margin)
-  {
-    Rect.Left = LEFT;
-    Rect.Right = RIGHT;
-    Rect.Top = TOP + pState->top_margin;
-    Rect.Bottom = TOP + pState->bot_margin - 1;
-    Pos.X = LEFT;
-    Pos.Y = TOP + pState->top_margin + 1;
-    CharInfo.Char.UnicodeChar = ' ';
-    CharInfo.Attributes = get_default_attr( TRUE );
-    ScrollConsoleScreenBuffer( hConOut, &Rect, NULL, Pos, &CharInfo );
+  get_info( &Info );
+  a->margins	= pState->tb_margins;
+  a->top	= TOP + pState->top_margin;
+  a->bottom	= TOP + pState->bot_margin;
+  a->win_top	= TOP;
+  a->win_bottom = BOTTOM;
+  a->last	= LAST;
+}
+
+// Move down n lines, scrolling at the bottom (margin).  The cursor stays on
+// the line where it scrolls, so whatever's left is scrolled at once.
+void MoveDown( BOOL home, int n )
+{
+  CONSOLE_SCREEN_BUFFER_INFO Info;
+  SCAREA area;
+  SCMOVE move;
+
+  get_info( &Info );
+  get_area( &area );
+  sc_down( &area, CUR.Y, n, &move );
+  if (move.n)
+    scroll_lines( move.top, move.bottom, move.n );
+  if (home)
+    CUR.X = 0;
+  if (home || CUR.Y != move.y)
+  {
+    CUR.Y = move.y;
+    move_cursor( CUR );
   }
-  else if (pState->tb_margins && CUR.Y == TOP)
+}
+
+// Move up n lines, scrolling at the top (margin).
+void MoveUp( int n )
+{
+  CONSOLE_SCREEN_BUFFER_INFO Info;
+  SCAREA area;
+  SCMOVE move;
+
+  get_info( &Info );
+  get_area( &area );
+  sc_up( &area, CUR.Y, n, &move );
+  if (move.n)
+    scroll_lines( move.top, move.bottom, move.n );
+  if (CUR.Y != move.y)
   {
-    // do nothing
+    CUR.Y = move.y;
+    move_cursor( CUR );
   }
-  else if (CUR.Y == 0)
+}
+
+
+// Read the delays from ANSICON_FLUSH ("min[,max]", in milliseconds) and the
+// largest buffer from ANSICON_BUFFER (in characters).
+void get_flush_settings( void )
+{
+  TCHAR  buf[24];
+  LPTSTR end;
+  DWORD  len;
+
+  len = GetEnvironmentVariable( L"ANSICON_FLUSH", buf, lenof(buf) );
+  if (len != 0 && len < lenof(buf))
   {
-    Rect.Left = LEFT;
-    Rect.Right = RIGHT;
-    Rect.Top = 0;
-    Rect.Bottom = LAST - 1;
-    Pos.X = LEFT;
-    Pos.Y = 1;
-    CharInfo.Char.UnicodeChar = ' ';
-    CharInfo.Attributes = get_default_attr( TRUE );
-    ScrollConsoleScreenBuffer( hConOut, &Rect, NULL, Pos, &CharInfo );
+    flush.min = ac_wcstoul( buf, &end, 10 );
+    if (*end == ',')
+      flush.max = ac_wcstoul( end + 1, NULL, 10 );
+    if (flush.max < flush.min)
+      flush.max = flush.min;
   }
-  else
+
+  len = GetEnvironmentVariable( L"ANSICON_BUFFER", buf, lenof(buf) );
+  if (len != 0 && len < lenof(buf))
   {
-    --CUR.Y;
-    SetConsoleCursorPos( hConOut, CUR );
+    len = ac_wcstoul( buf, NULL, 10 );
+    nBufferMax = (len < BUFFER_SIZE) ? BUFFER_SIZE :
+		 (len > DIRECT_MAX)  ? DIRECT_MAX  : len;
   }
 }
 
 
+// Select the color matching from ANSICON_NEAREST.
+void get_nearest_setting( void )
+{
+  TCHAR buf[8];
+  DWORD len;
+
+  len = GetEnvironmentVariable( L"ANSICON_NEAREST", buf, lenof(buf) );
+  if (len != 0 && len < lenof(buf))
+    oklab = (lstrcmpi( buf, L"oklab" ) == 0);
+}
+
+
 DWORD WINAPI FlushThread( LPVOID param )
 {
   for (;;)
   {
     WaitForSingleObject( hFlushTimer, INFINITE );
     EnterCriticalSection( &CritSect );
-    FlushBuffer();
+    fl_fired( &flush );
+    flush_why = FR_TIMER;
+    if (!QueueBuffer())
+      FlushConsole();
     LeaveCriticalSection( &CritSect );
   }
 }
@@ -2259,103 +3440,266 @@ DWORD WINAPI BellThread( LPVOID param )
 }
 
 
-//-----------------------------------------------------------------------------
-//   ParseAndPrintString(hDev, lpBuffer, nNumberOfBytesToWrite)
-// Parses the string lpBuffer, interprets the escapes sequences and prints the
-// characters in the device hDev (console).
-// The lexer is a three states automata.
-// If the number of arguments es_argc > MAX_ARG, only the MAX_ARG-1 firsts and
-// the last arguments are processed (no es_argv[] overflow).
-//-----------------------------------------------------------------------------
+// ========== Parser contexts
 
-BOOL
-ParseAndPrintString( HANDLE hDev,
-		     LPCVOID lpBuffer,
-		     DWORD nNumberOfBytesToWrite,
-		     LPDWORD lpNumberOfBytesWritten
-		     )
+// Each handle has its own parser state, so alternating between (say) stdout
+// and stderr doesn't lose a partial sequence.  The buffer is not flushed when
+// switching, but when the new handle writes to it (or otherwise accesses the
+// console), see claim_buffer.
+
+#define CONTEXTS 4
+
+typedef struct
+{
+  HANDLE h;
+  DWORD  used;			// for replacing the least recently used
+  int	 state;
+  TCHAR  prefix, prefix2, suffix, suffix2;
+  int	 ibytes;
+  int	 es_argc;
+  int	 es_argv[MAX_ARG];
+  int	 Pt_len;
+  TCHAR  Pt_arg[lenof(Pt_arg)];
+  BOOL	 shifted, G0_special, im;
+  WCHAR  ChPrev;
+} PARSER, *PPARSER;
+
+PARSER	parser[CONTEXTS];
+PPARSER cur_parser;		// context of hConOut
+
+
+// Save the parser state of hConOut and restore (or create) that of hDev.
+void switch_parser( HANDLE hDev )
 {
-  DWORD   i;
-  LPCTSTR s;
+  static DWORD used;
+  PPARSER p;
+  int	  c;
 
-  EnterCriticalSection( &CritSect );
+  // The attribute, cursor and grid apply after the buffer, so they can't be
+  // left for another handle.
+  if (pending_attr != -1 || pending_move || grid_h != NULL)
+    FlushConsole();
 
-  if (hDev != hConOut)	// reinit if device has changed
+  p = cur_parser;
+  if (p != NULL)
   {
-    FlushBuffer();
-    hConOut = hDev;
-    state = 1;
+    p->state	  = state;
+    p->prefix	  = prefix;
+    p->prefix2	  = prefix2;
+    p->suffix	  = suffix;
+    p->suffix2	  = suffix2;
+    p->ibytes	  = ibytes;
+    p->es_argc	  = es_argc;
+    arrcpy( p->es_argv, es_argv );
+    p->Pt_len	  = Pt_len;
+    // Strings only remember the last character, which is the first.
+    RtlMoveMemory( p->Pt_arg, Pt_arg, TSIZE(Pt_len + 1) );
+    p->shifted	  = shifted;
+    p->G0_special = G0_special;
+    p->im	  = im;
+    p->ChPrev	  = ChPrev;
+  }
+
+  hConOut = hDev;
+  csbi_valid = FALSE;
+
+  p = parser;
+  for (c = 0; c < CONTEXTS; ++c)
+  {
+    if (parser[c].h == hDev)
+    {
+      p = &parser[c];
+      break;
+    }
+    if (parser[c].used < p->used)
+      p = &parser[c];
+  }
+  p->used = ++used;
+  cur_parser = p;
+
+  if (p->h != hDev)
+  {
+    p->h = hDev;
+    state = S_GROUND;
     im = shifted = G0_special = FALSE;
+    return;
   }
-  for (i = nNumberOfBytesToWrite, s = (LPCTSTR)lpBuffer; i > 0; i--, s++)
+
+  state      = p->state;
+  prefix     = p->prefix;
+  prefix2    = p->prefix2;
+  suffix     = p->suffix;
+  suffix2    = p->suffix2;
+  ibytes     = p->ibytes;
+  es_argc    = p->es_argc;
+  arrcpy( es_argv, p->es_argv );
+  Pt_len     = p->Pt_len;
+  RtlMoveMemory( Pt_arg, p->Pt_arg, TSIZE(Pt_len + 1) );
+  shifted    = p->shifted;
+  G0_special = p->G0_special;
+  im	     = p->im;
+  ChPrev     = p->ChPrev;
+}
+
+
+//-----------------------------------------------------------------------------
+//   BeginWrite(hDev)
+// Prepares to write to the device hDev (console), locking until EndWrite.
+// A write is done with one BeginWrite, any number of ParseString (e.g. the
+// pieces of a conversion) and one EndWrite.
+//-----------------------------------------------------------------------------
+
+void BeginWrite( HANDLE hDev )
+{
+  EnterCriticalSection( &CritSect );
+
+  // Something else could have written to the console since the last time.
+  csbi_valid = FALSE;
+  nearest_valid = FALSE;
+  cells_valid = FALSE;
+
+  // Another thread could have checked another handle in the meantime.
+  IsConsoleHandle( hDev );
+
+  if (hDev != hConOut)	// switch state if device has changed
+    switch_parser( hDev );
+}
+
+//-----------------------------------------------------------------------------
+//   ParseString(s, len)
+// Parses the string s, interprets the escapes sequences and prints the
+// characters (after BeginWrite).  Returns the number of characters not done.
+// The lexer is table driven: each character is classified (char_class) and
+// the action for that class in the current state (parse_table) is performed.
+// If the number of arguments es_argc > MAX_ARG, only the MAX_ARG-1 firsts and
+// the last arguments are processed (no es_argv[] overflow).
+//-----------------------------------------------------------------------------
+
+DWORD ParseString( LPCTSTR s, DWORD len )
+{
+  DWORD i;
+
+  for (i = len; i > 0; i--, s++)
   {
     int c = *s; 		// more efficient to use int than short, fwiw
+    int cls = (c < 128) ? char_class[c] : CL_PRINT;
 
-    if (state == 1)
+  again:
+    switch (parse_table[state][cls])
     {
-      if (c == ESC)
-      {
+      case A_NONE:
+      break;
+
+      case A_PRINT:
+	if (c < ' ')
+	  PushBuffer( (WCHAR)c );
+	else
+	{
+	  // Add everything up to the next control in one go.
+	  DWORD n = tx_run( s, i );
+	  PushRun( s, n );
+	  s += n - 1;
+	  i -= n - 1;
+	}
+      break;
+
+      case A_BEL:
+	if (pState->crm)
+	  PushBuffer( (WCHAR)c );
+	else
+	{
+	  if (PlaySound == NULL)
+	  {
+	    winmm = LoadLibraryEx( L"winmm.dll", NULL, 0 );
+	    if (winmm != NULL)
+	      PlaySound = (FnPlaySound)GetProcAddress( winmm, "PlaySoundW" );
+	    if (PlaySound == NULL)
+	      PlaySound = INVALID_HANDLE_VALUE;
+	  }
+	  if (PlaySound == INVALID_HANDLE_VALUE)
+	    PushBuffer( (WCHAR)c );
+	  else if (hBell == NULL)
+	    hBell = CreateThread( NULL, 4096, BellThread, NULL, 0, NULL );
+	}
+      break;
+
+      case A_ESC:
 	suffix2 = 0;
 	ibytes = 0;
 	get_state();
-	state = (pState->crm) ? 7 : 2;
-      }
-      else if (pState->crm) PushBuffer( (WCHAR)c );
-      else if (c == BEL)
-      {
-	if (PlaySound == NULL)
+	state = (pState->crm) ? S_CRM_ESC : S_ESC;
+      break;
+
+      case A_SO:
+	if (pState->crm) PushBuffer( (WCHAR)c );
+	else shifted = TRUE;
+      break;
+
+      case A_SI:
+	if (pState->crm) PushBuffer( (WCHAR)c );
+	else shifted = G0_special;
+      break;
+
+      case A_HT:
+	if (pState->tabs && !pState->crm)
 	{
-	  winmm = LoadLibraryEx( L"winmm.dll", NULL, 0 );
-	  if (winmm != NULL)
-	    PlaySound = (FnPlaySound)GetProcAddress( winmm, "PlaySoundW" );
-	  if (PlaySound == NULL)
-	    PlaySound = INVALID_HANDLE_VALUE;
+	  CONSOLE_SCREEN_BUFFER_INFO Info;
+	  FlushBuffer();
+	  get_info( &Info );
+	  while (++CUR.X < MAX_TABS && !pState->tab_stop[CUR.X]) ;
+	  if (CUR.X > RIGHT) CUR.X = RIGHT;
+	  // Don't use set_pos, the tab could be discarded.
+	  move_cursor( CUR );
+	  break;
 	}
-	if (PlaySound == INVALID_HANDLE_VALUE)
+	// fall through
+
+      case A_FMT:
+	if (im && !pState->crm)
+	{
+	  FlushBuffer();
+	  im = FALSE;
 	  PushBuffer( (WCHAR)c );
-	else if (hBell == NULL)
-	  hBell = CreateThread( NULL, 4096, BellThread, NULL, 0, NULL );
-      }
-      else if (c == SO) shifted = TRUE;
-      else if (c == SI) shifted = G0_special;
-      else if (c == HT && pState->tabs)
-      {
-	CONSOLE_SCREEN_BUFFER_INFO Info;
-	FlushBuffer();
-	GetConsoleScreenBufferInfo( hConOut, &Info );
-	while (++CUR.X < MAX_TABS && !pState->tab_stop[CUR.X]) ;
-	if (CUR.X > RIGHT) CUR.X = RIGHT;
-	// Don't use set_pos, the tab could be discarded.
-	SetConsoleCursorPos( hConOut, CUR );
-      }
-      else if (im && (c == HT || c == '\r' || c == '\b' || c == '\n'))
-      {
-	FlushBuffer();
-	im = FALSE;
-	PushBuffer( (WCHAR)c );
-	FlushBuffer();
-	im = TRUE;
-      }
-      else PushBuffer( (WCHAR)c );
-    }
-    else if (state == 2)
-    {
-      if (c < '\x20')
-      {
+	  FlushBuffer();
+	  im = TRUE;
+	}
+	else
+	{
+	  PushBuffer( (WCHAR)c );
+	  if (c == '\n' && nLinesInBuffer == 0 && !pState->crm)
+	  {
+	    // It wasn't kept for jump scroll, so do the rest of a run of newlines
+	    // (and CRs, which do nothing after them) at once.
+	    unsigned long last;
+	    unsigned long n = tx_newlines( s + 1, i - 1, &last );
+	    if (n)
+	    {
+	      MoveDown( TRUE, n );
+	      s += last;
+	      i -= last;
+	    }
+	  }
+	}
+      break;
+
+      case A_CONTROL:
 	FlushBuffer();
+	hPending = hConOut;
 	pState->crm = TRUE;
 	ChBuffer[nCharInBuffer++] = c;	// skip newline handling
 	FlushBuffer();
 	pState->crm = FALSE;
-	state = 1;
-      }
-      else if (c >= '\x20' && c <= '\x2f')
-      {
+	state = S_GROUND;
+      break;
+
+      case A_INTER:
 	suffix2 = c;
 	++ibytes;
-      }
-      else if (ibytes != 0)
-      {
+	if (state == S_ESC)
+	  state = S_ESC_INT;
+      break;
+
+      case A_SCS:
 	if (ibytes == 1 &&
 	    suffix2 == '(')     // SCS - Designate G0 character set
 	{
@@ -2364,69 +3708,102 @@ ParseAndPrintString( HANDLE hDev,
 	  else if (c == 'B')
 	    shifted = G0_special = FALSE;
 	}
-	state = 1;
-      }
-      else if (c == 'E')        // NEL Next Line
-      {
-	PushBuffer( '\n' );
-	state = 1;
-      }
-      else if (c == 'D')        // IND Index
-      {
-	FlushBuffer();
-	MoveDown( FALSE );
-	state = 1;
-      }
-      else if (c == 'M')        // RI  Reverse Index
-      {
-	FlushBuffer();
-	MoveUp();
-        state = 1;
-      }
-      else if (c == 'H')        // HTS Character Tabulation Set
-      {
-	CONSOLE_SCREEN_BUFFER_INFO Info;
-	if (!pState->tabs) init_tabs( 8 );
-	FlushBuffer();
-	GetConsoleScreenBufferInfo( hConOut, &Info );
-	if (CUR.X < MAX_TABS) pState->tab_stop[CUR.X] = TRUE;
-	state = 1;
-      }
-      else if (c == '7')        // DECSC Save Cursor
-      {
-	CONSOLE_SCREEN_BUFFER_INFO Info;
-	FlushBuffer();
-	GetConsoleScreenBufferInfo( hConOut, &Info );
-	pState->SavePos = CUR;
-	pState->SaveSgr = pState->sgr;
-	pState->SaveAttr = ATTR;
-	SaveG0 = G0_special;
-	state = 1;
-      }
-      else if (c == '8')        // DECRC Restore Cursor
-      {
-	CONSOLE_SCREEN_BUFFER_INFO Info;
-	FlushBuffer();
-	GetConsoleScreenBufferInfo( hConOut, &Info );
-	CUR = pState->SavePos;
-	if (CUR.X > RIGHT) CUR.X = RIGHT;
-	if (CUR.Y > LAST)  CUR.Y = LAST;
-	set_pos( CUR.X, CUR.Y );
-	if (pState->SaveAttr != 0)  // assume 0 means not saved
+	state = S_GROUND;
+      break;
+
+      case A_ESC_FINAL:
+	state = S_GROUND;
+	switch (c)
 	{
-	  pState->sgr = pState->SaveSgr;
-	  SetConsoleTextAttribute( hConOut, pState->SaveAttr );
-	  shifted = G0_special = SaveG0;
+	  case 'E':             // NEL Next Line
+	    PushBuffer( '\n' );
+	    if (nLinesInBuffer == 0 && !pState->crm)
+	    {
+	      // It wasn't kept for jump scroll, so do a run of them at once.
+	      int n = 0;
+	      while (i > 2 && s[1] == ESC && s[2] == 'E')
+	      {
+		++n;
+		s += 2;
+		i -= 2;
+	      }
+	      if (n)
+		MoveDown( TRUE, n );
+	    }
+	  break;
+
+	  case 'D':             // IND Index
+	  case 'M':             // RI  Reverse Index
+	  {
+	    // Do a run of them at once.
+	    int n = 1;
+	    while (i > 2 && s[1] == ESC && s[2] == c)
+	    {
+	      ++n;
+	      s += 2;
+	      i -= 2;
+	    }
+	    FlushBuffer();
+	    if (c == 'D')
+	      MoveDown( FALSE, n );
+	    else
+	      MoveUp( n );
+	  }
+	  break;
+
+	  case 'H':             // HTS Character Tabulation Set
+	  {
+	    CONSOLE_SCREEN_BUFFER_INFO Info;
+	    if (!pState->tabs) init_tabs( 8 );
+	    FlushBuffer();
+	    get_info( &Info );
+	    if (CUR.X < MAX_TABS) pState->tab_stop[CUR.X] = TRUE;
+	  }
+	  break;
+
+	  case '7':             // DECSC Save Cursor
+	  {
+	    CONSOLE_SCREEN_BUFFER_INFO Info;
+	    FlushBuffer();
+	    get_info( &Info );
+	    pState->SavePos = CUR;
+	    pState->SaveSgr = pState->sgr;
+	    pState->SaveAttr = ATTR;
+	    SaveG0 = G0_special;
+	  }
+	  break;
+
+	  case '8':             // DECRC Restore Cursor
+	  {
+	    CONSOLE_SCREEN_BUFFER_INFO Info;
+	    FlushBuffer();
+	    get_info( &Info );
+	    CUR = pState->SavePos;
+	    if (CUR.X > RIGHT) CUR.X = RIGHT;
+	    if (CUR.Y > LAST)  CUR.Y = LAST;
+	    set_pos( CUR.X, CUR.Y );
+	    if (pState->SaveAttr != 0)	// assume 0 means not saved
+	    {
+	      pState->sgr = pState->SaveSgr;
+	      set_attr( pState->SaveAttr );
+	      shifted = G0_special = SaveG0;
+	    }
+	  }
+	  break;
+
+	  case 'c':             // RIS Reset to Initial State
+	    Reset( TRUE );
+	  break;
+
+	  default:
+	    PushBuffer( ESC );
+	    PushBuffer( (WCHAR)c );
+	  break;
 	}
-	state = 1;
-      }
-      else if (c == 'c')        // RIS Reset to Initial State
-      {
-	Reset( TRUE );
-      }
-      else if (c == '[' ||      // CSI Control Sequence Introducer
-	       c == ']')        // OSC Operating System Command
-      {
+      break;
+
+      case A_CSI:		// CSI Control Sequence Introducer
+				// OSC Operating System Command
 	FlushBuffer();
 	prefix = c;
 	prefix2 = 0;
@@ -2434,193 +3811,221 @@ ParseAndPrintString( HANDLE hDev,
 	es_argv[0] = es_argv[1] = 0;
 	Pt_len = 0;
 	*Pt_arg = '\0';
-	state = 3;
-      }
-      else if (c == 'P' ||      // DCS Device Control String
-	       c == 'X' ||      // SOS Start Of String
-	       c == '^' ||      // PM  Privacy Message
-	       c == '_')        // APC Application Program Command
-      {
+	state = S_CSI;
+      break;
+
+      case A_STRING:		// DCS Device Control String
+				// SOS Start Of String
+				// PM  Privacy Message
+				// APC Application Program Command
 	*Pt_arg = '\0';
-	state = 6;
-      }
-      else
-      {
-	PushBuffer( ESC );
-	PushBuffer( (WCHAR)c );
-	state = 1;
-      }
-    }
-    else if (state == 3)
-    {
-      if (is_digit( c ))
-      {
+	state = S_STR;
+      break;
+
+      case A_FIRST_ARG:
 	es_argv[0] = c - '0';
-        state = 4;
-      }
-      else if (c == ';')
-      {
-        es_argc = 1;
-        state = 4;
-      }
-      else if (c == ':')
-      {
-	// ignore it
-      }
-      else if (c >= '\x3c' && c <= '\x3f')
-      {
+	state = S_PARAM;
+      break;
+
+      case A_FIRST_SEP:
+	es_argc = 1;
+	state = S_PARAM;
+      break;
+
+      case A_PRIVATE:
 	prefix2 = c;
-      }
-      else if (c >= '\x20' && c <= '\x2f')
-      {
-	suffix2 = c;
-	++ibytes;
-      }
-      else if (ibytes > 1)
-      {
-	state = 1;
-      }
-      else
-      {
-        es_argc = 0;
-        suffix = c;
-        InterpretEscSeq();
-        state = 1;
-      }
-    }
-    else if (state == 4)
-    {
-      if (is_digit( c ))
-      {
+      break;
+
+      case A_CSI_FINAL:
+	if (ibytes <= 1)
+	{
+	  es_argc = 0;
+	  suffix = c;
+	  InterpretEscSeq();
+	}
+	state = S_GROUND;
+      break;
+
+      case A_ARG:
 	es_argv[es_argc] = 10 * es_argv[es_argc] + (c - '0');
 	if (es_argv[es_argc] > 32767) es_argv[es_argc] = 32767;
-      }
-      else if (c == ';')
-      {
-        if (es_argc < MAX_ARG-1) es_argc++;
+      break;
+
+      case A_SEP:
+	if (es_argc < MAX_ARG-1) es_argc++;
 	es_argv[es_argc] = 0;
 	if (prefix == ']')
-	  state = 5;
-      }
-      else if (c >= '\x3a' && c <= '\x3f')
-      {
-	// ignore 'em
-      }
-      else if (c >= '\x20' && c <= '\x2f')
-      {
-	suffix2 = c;
-	++ibytes;
-      }
-      else if (ibytes > 1)
-      {
-	state = 1;
-      }
-      else if (prefix == ']')
-      {
-	es_argc++;
-	state = 5;
-	goto state5;
-      }
-      else
-      {
-	es_argc++;
-        suffix = c;
-        InterpretEscSeq();
-        state = 1;
-      }
-    }
-    else if (state == 5)
-    {
-    state5:
-      if (c == BEL)
-      {
+	  state = S_OSC_STR;
+      break;
+
+      case A_FINAL:
+	if (ibytes > 1)
+	{
+	  state = S_GROUND;
+	}
+	else if (prefix == ']')
+	{
+	  es_argc++;
+	  state = S_OSC_STR;
+	  goto again;
+	}
+	else
+	{
+	  es_argc++;
+	  suffix = c;
+	  InterpretEscSeq();
+	  state = S_GROUND;
+	}
+      break;
+
+      case A_OSC_ST:
+	if (Pt_len > 0 && Pt_arg[Pt_len-1] == ESC)
+	{
+	  Pt_arg[--Pt_len] = '\0';
+	  InterpretEscSeq();
+	  state = S_GROUND;
+	  break;
+	}
+	// fall through
+
+      case A_OSC_PUT:
+	if (Pt_len < lenof(Pt_arg)-1)
+	  Pt_arg[Pt_len++] = c;
+      break;
+
+      case A_OSC_END:
 	Pt_arg[Pt_len] = '\0';
-        InterpretEscSeq();
-        state = 1;
-      }
-      else if (c == '\\' && Pt_len > 0 && Pt_arg[Pt_len-1] == ESC)
-      {
-	Pt_arg[--Pt_len] = '\0';
-        InterpretEscSeq();
-        state = 1;
-      }
-      else if (Pt_len < lenof(Pt_arg)-1)
-	Pt_arg[Pt_len++] = c;
-    }
-    else if (state == 6)
-    {
-      if (c == BEL || (c == '\\' && *Pt_arg == ESC))
-	state = 1;
-      else
+	InterpretEscSeq();
+	state = S_GROUND;
+      break;
+
+      case A_STR_ST:
+	if (*Pt_arg == ESC)
+	{
+	  state = S_GROUND;
+	  break;
+	}
+	// fall through
+
+      case A_STR_PUT:
 	*Pt_arg = c;
-    }
-    else if (state == 7)
-    {
-      if (c == '[') state = 8;
-      else
-      {
-	PushBuffer( ESC );
-	if (c != ESC)
+      break;
+
+      case A_STR_END:
+	state = S_GROUND;
+      break;
+
+      case A_CRM:
+	if (state == S_CRM_ESC)
 	{
-	  PushBuffer( (WCHAR)c );
-	  state = 1;
+	  if (c == '[') state = S_CRM_CSI;
+	  else
+	  {
+	    PushBuffer( ESC );
+	    if (c != ESC)
+	    {
+	      PushBuffer( (WCHAR)c );
+	      state = S_GROUND;
+	    }
+	  }
 	}
-      }
-    }
-    else if (state == 8)
-    {
-      if (c == '3') state = 9;
-      else
-      {
-	PushBuffer( ESC );
-	PushBuffer( '[' );
-	if (c == ESC) state = 7;
-	else
+	else if (state == S_CRM_CSI)
 	{
-	  PushBuffer( (WCHAR)c );
-	  state = 1;
+	  if (c == '3') state = S_CRM_3;
+	  else
+	  {
+	    PushBuffer( ESC );
+	    PushBuffer( '[' );
+	    if (c == ESC) state = S_CRM_ESC;
+	    else
+	    {
+	      PushBuffer( (WCHAR)c );
+	      state = S_GROUND;
+	    }
+	  }
 	}
-      }
-    }
-    else if (state == 9)
-    {
-      if (c == 'l')
-      {
-	FlushBuffer();
-	pState->crm = FALSE;
-	state = 1;
-      }
-      else
-      {
-	PushBuffer( ESC );
-	PushBuffer( '[' );
-	PushBuffer( '3' );
-	if (c == ESC) state = 7;
-	else
+	else // (state == S_CRM_3)
 	{
-	  PushBuffer( (WCHAR)c );
-	  state = 1;
+	  if (c == 'l')
+	  {
+	    FlushBuffer();
+	    pState->crm = FALSE;
+	    state = S_GROUND;
+	  }
+	  else
+	  {
+	    PushBuffer( ESC );
+	    PushBuffer( '[' );
+	    PushBuffer( '3' );
+	    if (c == ESC) state = S_CRM_ESC;
+	    else
+	    {
+	      PushBuffer( (WCHAR)c );
+	      state = S_GROUND;
+	    }
+	  }
 	}
-      }
+      break;
     }
   }
-  if (nCharInBuffer > 0)
+  return i;
+}
+
+//-----------------------------------------------------------------------------
+//   EndWrite()
+// Finishes a write, deciding when to flush what's been collected.
+//-----------------------------------------------------------------------------
+
+void EndWrite( void )
+{
+  if (nCharInBuffer > 0 || pending_move || grid.dirty)
   {
-    if (pState->fm && ChBuffer[nCharInBuffer-1] != '\r') FlushBuffer();
-    else
+    int when = fl_write( &flush, GetTickCount(), pState->fm,
+			 (nCharInBuffer != 0 &&
+			  ChBuffer[nCharInBuffer-1] == '\r') );
+    if (when == FL_NOW)
+    {
+      flush_why = FR_WRITE;
+      FlushBuffer();
+      grid_sync();
+      apply_pos();
+      if (flush.delay == 0)
+	shrink_buffers();
+    }
+    else if (when == FL_ARM)
     {
       LARGE_INTEGER due;
-      due.QuadPart = -150000;
+      due.QuadPart = Int32x32To64( -10000, flush.wait );
       if (hFlush == NULL)
 	hFlush = CreateThread( NULL, 4096, FlushThread, NULL, 0, NULL );
       SetWaitableTimer( hFlushTimer, &due, 0, NULL, NULL, FALSE );
     }
   }
+  LeaveCriticalSection( &CritSect );
+}
+
+//-----------------------------------------------------------------------------
+//   ParseAndPrintString(hDev, lpBuffer, nNumberOfBytesToWrite)
+// Parses the string lpBuffer, interprets the escapes sequences and prints the
+// characters in the device hDev (console).
+//-----------------------------------------------------------------------------
+
+BOOL
+ParseAndPrintString( HANDLE hDev,
+		     LPCVOID lpBuffer,
+		     DWORD nNumberOfBytesToWrite,
+		     LPDWORD lpNumberOfBytesWritten
+		     )
+{
+  DWORD i;
+
+  BeginWrite( hDev );
+  i = ParseString( lpBuffer, nNumberOfBytesToWrite );
+  EndWrite();
+
   if (lpNumberOfBytesWritten != NULL)
     *lpNumberOfBytesWritten = nNumberOfBytesToWrite - i;
 
-  LeaveCriticalSection( &CritSect );
-
   return (i == 0);
 }
 
@@ -2911,7 +4316,7 @@ BOOL HookAPIAllMod( PHookFn Hooks, BOOL restore, BOOL indent )
 	continue;
       }
     }
-    if (search_env( L"ANSICON_EXC", me.szModule ))
+    if (search_env( ENV_EXC, me.szModule ))
     {
       DEBUGSTR( 2, "%s%s %S", sp, zIgnoring, me.szModule );
       continue;
@@ -3016,7 +4421,7 @@ void Inject( DWORD dwCreationFlags, LPPROCESS_INFORMATION lpi,
 
   name = get_program( app, child_pi->hProcess, wide, lpApp, lpCmd );
   DEBUGSTR( 1, "%S (%u)", name, child_pi->dwProcessId );
-  if (!ansicon && search_env( L"ANSICON_EXC", name ))
+  if (!ansicon && search_env( ENV_EXC, name ))
   {
     DEBUGSTR( 1, "  Excluded" );
     type = 0;
@@ -3026,7 +4431,7 @@ void Inject( DWORD dwCreationFlags, LPPROCESS_INFORMATION lpi,
     type = ProcessType( child_pi, &base, &gui );
     if (!ansicon && gui && type > 0)
     {
-      if (!search_env( L"ANSICON_GUI", name ))
+      if (!search_env( ENV_GUI, name ))
       {
 	DEBUGSTR( 1, "  %s", zIgnoring );
 	type = 0;
@@ -3123,6 +4528,7 @@ BOOL WINAPI MyCreateProcessA( LPCSTR lpApplicationName,
 
   // May need to initialise the state, to propagate environment variables.
   get_state();
+  FlushConsole();
   if (!CreateProcessA( lpApplicationName,
 		       lpCommandLine,
 		       lpThreadAttributes,
@@ -3163,6 +4569,7 @@ BOOL WINAPI MyCreateProcessW( LPCWSTR lpApplicationName,
   DEBUGSTR( 1, "CreateProcessW: %\"S, %#S", lpApplicationName, lpCommandLine );
 
   get_state();
+  FlushConsole();
   if (!CreateProcessW( lpApplicationName,
 		       lpCommandLine,
 		       lpThreadAttributes,
@@ -3300,50 +4707,104 @@ HMODULE WINAPI MyLoadLibraryExW( LPCWSTR lpFileName, HANDLE hFile,
 }
 
 
-//-----------------------------------------------------------------------------
-//   IsConsoleHandle
-// Determine if the handle is writing to the console, with processed output.
-//-----------------------------------------------------------------------------
-BOOL IsConsoleHandle( HANDLE h )
+// Find a handle in the table (without locking), setting its mode.
+BOOL known_handle( HANDLE h, LPDWORD mode )
 {
-  int c;
+  struct Handle* p = HANDLE_SLOT( h );
+  LONG seq;
 
-  EnterCriticalSection( &CritSect );
-
-  for (c = 0; c < CACHE; ++c)
-    if (cache[c].h == h)
+  seq = p->seq;
+  if (!(seq & 1) && p->h == h)
+  {
+    *mode = p->mode;
+    if (p->seq == seq)
     {
-      if (c != 0)
-      {
-	struct Cache tc = cache[c];
-	do cache[c] = cache[c-1]; while (--c > 0);
-	cache[0] = tc;
-      }
-      c = (cache[0].mode & ENABLE_PROCESSED_OUTPUT);
-      LeaveCriticalSection( &CritSect );
-      return c;
+      ++stat_handle_hit;
+      return TRUE;
     }
+  }
+  return FALSE;
+}
 
-  while (--c > 0)
-    cache[c] = cache[c-1];
 
-  cache[0].h = h;
-  cache[0].mode = 0;
-  if (!GetConsoleMode( h, &cache[0].mode ))
+// Get the mode of a handle, with CON_HANDLE if it's the console (input or
+// output), or 0 if it's not.
+DWORD handle_mode( HANDLE h )
+{
+  struct Handle* p = HANDLE_SLOT( h );
+  DWORD mode;
+
+  // The handle could have been closed without CloseHandle (NtClose, say) and
+  // its value reused, so check a console is still a character device when
+  // it's not the one being written (the table would otherwise need clearing
+  // each time that changes).
+  if (known_handle( h, &mode ) &&
+      (!(mode & CON_HANDLE) || h == hConOut ||
+       GetFileType( h ) == FILE_TYPE_CHAR))
+    return mode;
+
+  EnterCriticalSection( &CritSect );
+
+  ++stat_handle_miss;
+  if (GetConsoleMode( h, &mode ))
+    mode |= CON_HANDLE;
+  else
   {
     // GetConsoleMode could fail if the console was not opened for reading
     // (which is what Microsoft's conio output does).  Verify the handle with
     // WriteConsole (processed output is the default).
     DWORD written;
-    if (WriteConsole( h, NULL, 0, &written, NULL ))
-      cache[0].mode = ENABLE_PROCESSED_OUTPUT;
+    mode = (WriteConsole( h, NULL, 0, &written, NULL ))
+	   ? ENABLE_PROCESSED_OUTPUT | CON_HANDLE : 0;
   }
+  ++p->seq;
+  p->h = h;
+  p->mode = mode;
+  ++p->seq;
+
+  LeaveCriticalSection( &CritSect );
+
+  return mode;
+}
 
-  c = (cache[0].mode & ENABLE_PROCESSED_OUTPUT);
+// Forget a handle, since its value could be reused for something else.
+void forget_handle( HANDLE h )
+{
+  struct Handle* p = HANDLE_SLOT( h );
 
+  if (p->h != h)
+    return;
+  EnterCriticalSection( &CritSect );
+  if (p->h == h)
+  {
+    ++p->seq;
+    p->h = NULL;
+    p->mode = 0;
+    ++p->seq;
+  }
   LeaveCriticalSection( &CritSect );
+}
+
+// Test the handle without making its mode current (which needs the lock).
+#define IS_CONSOLE( h ) (handle_mode( h ) & ENABLE_PROCESSED_OUTPUT)
+
+//-----------------------------------------------------------------------------
+//   IsConsoleHandle
+// Determine if the handle is writing to the console, with processed output,
+// making its mode current.
+//-----------------------------------------------------------------------------
+BOOL IsConsoleHandle( HANDLE h )
+{
+  DWORD mode = handle_mode( h );
 
-  return c;
+  if (mode & ENABLE_PROCESSED_OUTPUT)
+  {
+    EnterCriticalSection( &CritSect );
+    conmode = mode & ~CON_HANDLE;
+    LeaveCriticalSection( &CritSect );
+    return TRUE;
+  }
+  return FALSE;
 }
 
 //-----------------------------------------------------------------------------
@@ -3356,19 +4817,31 @@ WINAPI MySetConsoleMode( HANDLE hCon, DWORD mode )
 {
   BOOL rc;
 
-  FlushBuffer();
+  FlushConsole();
 
   rc = SetConsoleMode( hCon, mode );
   if (rc)
   {
-    int c;
-    for (c = 0; c < CACHE; ++c)
+    struct Handle* p;
+    DWORD m;
+
+    EnterCriticalSection( &CritSect );
+    for (p = handles; p < handles + HANDLES; ++p)
     {
       // The mode is associated with the buffer, not the handle.
-      GetConsoleMode( cache[c].h, &cache[c].mode );
+      if (p->mode != 0 && GetConsoleMode( p->h, &m ))
+      {
+	++p->seq;
+	p->mode = m | CON_HANDLE;
+	++p->seq;
+      }
     }
+    p = HANDLE_SLOT( hConOut );
+    if (p->h == hConOut && p->mode != 0)
+      conmode = p->mode & ~CON_HANDLE;
     if (hCon == hConOut)
       awm = (mode & ENABLE_WRAP_AT_EOL_OUTPUT) ? TRUE : FALSE;
+    LeaveCriticalSection( &CritSect );
   }
   return rc;
 }
@@ -3383,6 +4856,73 @@ WINAPI MySetConsoleMode( HANDLE hCon, DWORD mode )
 
 static LPCSTR write_func;
 
+// Convert complete UTF-8 sequences in pieces that fit in buf and parse each
+// piece while it's still in the cache.  ASCII (which includes the escape
+// sequences) is simply widened; only the runs of other characters go through
+// MultiByteToWideChar.  A UTF-8 byte never becomes more than one WCHAR.  The
+// pieces are all part of the one write (after BeginWrite).
+BOOL ParseUTF8( LPCSTR aBuf, DWORD len,
+		LPWSTR buf, DWORD size, LPDWORD lpNumberOfCharsWritten )
+{
+  DWORD  n, i, end, wlen, left, total;
+  BOOL	 rc = TRUE;
+
+  total = 0;
+  while (len != 0)
+  {
+    n = (len > size) ? size : len;
+    if (n < len)
+    {
+      // Don't split a sequence (unless it's just a run of trail bytes).
+      i = n;
+      while (i > 0 && (aBuf[i] & 0xC0) == 0x80)
+	--i;
+      if (i > 0)
+	n = i;
+    }
+    wlen = 0;
+    for (i = 0; i < n;)
+    {
+#ifdef HAVE_SSE2
+      if (n - i >= 16)
+      {
+	__m128i v = _mm_loadu_si128( (const __m128i*)(aBuf + i) );
+	if (_mm_movemask_epi8( v ) == 0)
+	{
+	  __m128i zero = _mm_setzero_si128();
+	  _mm_storeu_si128( (__m128i*)(buf + wlen), _mm_unpacklo_epi8( v, zero ) );
+	  _mm_storeu_si128( (__m128i*)(buf + wlen + 8),
+			    _mm_unpackhi_epi8( v, zero ) );
+	  wlen += 16;
+	  i += 16;
+	  continue;
+	}
+      }
+#endif
+      if (!(aBuf[i] & 0x80))
+	buf[wlen++] = aBuf[i++];
+      else
+      {
+	end = i;
+	while (++end < n && (aBuf[end] & 0x80))
+	  ;
+	wlen += MultiByteToWideChar( CP_UTF8, 0, aBuf + i, end - i,
+				     buf + wlen, size - wlen );
+	i = end;
+      }
+    }
+    left = ParseString( buf, wlen );
+    total += wlen - left;
+    rc = (left == 0);
+    aBuf += n;
+    len -= n;
+  }
+  if (lpNumberOfCharsWritten != NULL)
+    *lpNumberOfCharsWritten = total;
+
+  return rc;
+}
+
 BOOL
 WINAPI MyWriteConsoleA( HANDLE hCon, LPCVOID lpBuffer,
 			DWORD nNumberOfCharsToWrite,
@@ -3390,19 +4930,20 @@ WINAPI MyWriteConsoleA( HANDLE hCon, LPCVOID lpBuffer,
 {
   LPWSTR buf;
   WCHAR  wBuf[1024];
-  DWORD  len, wlen;
+  DWORD  len, wlen, left;
   UINT	 cp;
   BOOL	 rc = TRUE;
   LPCSTR aBuf;
   static char  mb[4];
   static DWORD mb_len, mb_size;
 
-  if (nNumberOfCharsToWrite != 0 && IsConsoleHandle( hCon ))
+  if (nNumberOfCharsToWrite != 0 && IS_CONSOLE( hCon ))
   {
     DEBUGSTR( 4, "%s: %u %\"<s",
 		 (write_func == NULL) ? "WriteConsoleA" : write_func,
 		 nNumberOfCharsToWrite, lpBuffer );
     write_func = NULL;
+    BeginWrite( hCon );
     aBuf = lpBuffer;
     len = nNumberOfCharsToWrite;
     wlen = 0;
@@ -3420,7 +4961,7 @@ WINAPI MyWriteConsoleA( HANDLE hCon, LPCVOID lpBuffer,
 	DEBUGSTR( 4, "  %strail byte, removing & writing %\"*s",
 		     (len == 0) ? "" : "starts with a ", 2, mb );
 	wlen = MultiByteToWideChar( cp, 0, mb, 2, wBuf, lenof(wBuf) );
-	ParseAndPrintString( hCon, wBuf, wlen, NULL );
+	ParseString( wBuf, wlen );
 	mb_len = 0;
       }
       // A lead byte might also be a trail byte, so count all consecutive lead
@@ -3476,7 +5017,7 @@ WINAPI MyWriteConsoleA( HANDLE hCon, LPCVOID lpBuffer,
 			 tlen, mb_len, mb );
 	}
 	wlen = MultiByteToWideChar( cp, 0, mb, mb_len, wBuf, lenof(wBuf) );
-	ParseAndPrintString( hCon, wBuf, wlen, NULL );
+	ParseString( wBuf, wlen );
 	mb_len = 0;
       }
       // In UTF-8, the high bit set means a lead or trail byte; if the next
@@ -3523,32 +5064,43 @@ WINAPI MyWriteConsoleA( HANDLE hCon, LPCVOID lpBuffer,
 	*lpNumberOfCharsWritten = wlen;
       goto check_written;
     }
-    if (len <= lenof(wBuf))
-      buf = wBuf;
+    if (cp == CP_UTF8)
+      rc = ParseUTF8( aBuf, len, wBuf, lenof(wBuf),
+		      lpNumberOfCharsWritten );
     else
     {
-      buf = HeapAlloc( hHeap, 0, TSIZE(len) );
-      if (buf == NULL)
+      if (len <= lenof(wBuf))
+	buf = wBuf;
+      else
       {
-	DEBUGSTR( 4, "HeapAlloc failed, using original function" );
-	rc = WriteConsoleA( hCon, aBuf,len, lpNumberOfCharsWritten,lpReserved );
-	goto check_written;
+	buf = HeapAlloc( hHeap, 0, TSIZE(len) );
+	if (buf == NULL)
+	{
+	  DEBUGSTR( 4, "HeapAlloc failed, using original function" );
+	  rc = WriteConsoleA( hCon, aBuf, len, lpNumberOfCharsWritten,
+			      lpReserved );
+	  goto check_written;
+	}
       }
+      len = MultiByteToWideChar( cp, 0, aBuf, len, buf, len );
+      left = ParseString( buf, len );
+      if (lpNumberOfCharsWritten != NULL)
+	*lpNumberOfCharsWritten = len - left;
+      rc = (left == 0);
+      if (buf != wBuf)
+	HeapFree( hHeap, 0, buf );
     }
-    len = MultiByteToWideChar( cp, 0, aBuf, len, buf, len );
-    rc = ParseAndPrintString( hCon, buf, len, lpNumberOfCharsWritten );
     if (wlen != 0 && rc && lpNumberOfCharsWritten != NULL)
       *lpNumberOfCharsWritten += wlen;
-    if (buf != wBuf)
-      HeapFree( hHeap, 0, buf );
   check_written:
+    EndWrite();
     if (rc && lpNumberOfCharsWritten != NULL &&
 	      *lpNumberOfCharsWritten != nNumberOfCharsToWrite)
     {
       // I set the number of characters actually written, which may be 0 when
       // multibyte characters are split across calls.  If that causes problems,
       // restore original behaviour.
-      if (search_env( L"ANSICON_API", prog ))
+      if (search_env( ENV_API, prog ))
 	*lpNumberOfCharsWritten = nNumberOfCharsToWrite;
     }
     return rc;
@@ -3563,7 +5115,7 @@ WINAPI MyWriteConsoleW( HANDLE hCon, LPCVOID lpBuffer,
 			DWORD nNumberOfCharsToWrite,
 			LPDWORD lpNumberOfCharsWritten, LPVOID lpReserved )
 {
-  if (nNumberOfCharsToWrite != 0 && IsConsoleHandle( hCon ))
+  if (nNumberOfCharsToWrite != 0 && IS_CONSOLE( hCon ))
   {
     DEBUGSTR( 4, "WriteConsoleW: %u %\"<S",
 		 nNumberOfCharsToWrite, lpBuffer );
@@ -3583,7 +5135,7 @@ WINAPI MyWriteFile( HANDLE hFile, LPCVOID lpBuffer, DWORD nNumberOfBytesToWrite,
   if (HandleToULong( hFile ) == STD_OUTPUT_HANDLE ||
       HandleToULong( hFile ) == STD_ERROR_HANDLE)
     hFile = GetStdHandle( HandleToULong( hFile ) );
-  if (nNumberOfBytesToWrite != 0 && IsConsoleHandle( hFile ))
+  if (nNumberOfBytesToWrite != 0 && IS_CONSOLE( hFile ))
   {
     write_func = "WriteFile";
     MyWriteConsoleA( hFile, lpBuffer,nNumberOfBytesToWrite, NULL,lpOverlapped );
@@ -3602,7 +5154,7 @@ WINAPI MyWriteFile( HANDLE hFile, LPCVOID lpBuffer, DWORD nNumberOfBytesToWrite,
 UINT
 WINAPI My_lwrite( HFILE hFile, LPCSTR lpBuffer, UINT uBytes )
 {
-  if (uBytes != 0 && IsConsoleHandle( HHFILE hFile ))
+  if (uBytes != 0 && IS_CONSOLE( HHFILE hFile ))
   {
     write_func = "_lwrite";
     MyWriteConsoleA( HHFILE hFile, lpBuffer, uBytes, NULL, NULL );
@@ -3616,6 +5168,9 @@ WINAPI My_lwrite( HFILE hFile, LPCSTR lpBuffer, UINT uBytes )
 VOID
 WINAPI MyExitProcess( UINT uExitCode )
 {
+  // Finish writing before the threads are terminated.
+  flush_why = FR_EXIT;
+  FlushConsole();
   if (hBell != NULL)
     WaitForSingleObject( hBell, INFINITE );
   ExitProcess( uExitCode );
@@ -3721,6 +5276,8 @@ WINAPI MyCreateFileA( LPCSTR lpFileName, DWORD dwDesiredAccess,
   h = CreateFileA( lpFileName, dwDesiredAccess, dwShareMode,
 		   lpSecurityAttributes, dwCreationDisposition,
 		   dwFlagsAndAttributes, hTemplateFile );
+  if (h != INVALID_HANDLE_VALUE)
+    forget_handle( h );
   if (log_level & 32)
     log_CreateFile( h, name, FALSE, access,
 		    dwDesiredAccess, dwCreationDisposition );
@@ -3760,6 +5317,8 @@ WINAPI MyCreateFileW( LPCWSTR lpFileName, DWORD dwDesiredAccess,
   h = CreateFileW( lpFileName, dwDesiredAccess, dwShareMode,
 		   lpSecurityAttributes, dwCreationDisposition,
 		   dwFlagsAndAttributes, hTemplateFile );
+  if (h != INVALID_HANDLE_VALUE)
+    forget_handle( h );
   if (log_level & 32)
     log_CreateFile( h, name, TRUE, access,
 		    dwDesiredAccess, dwCreationDisposition );
@@ -3771,33 +5330,88 @@ WINAPI MyCreateConsoleScreenBuffer( DWORD dwDesiredAccess, DWORD dwShareMode,
 				    const SECURITY_ATTRIBUTES* lpSecurityAttributes,
 				    DWORD dwFlags, LPVOID lpScreenBufferData )
 {
+  HANDLE h;
+
   dwDesiredAccess |= GENERIC_READ;
-  return CreateConsoleScreenBuffer( dwDesiredAccess, dwShareMode,
-				    lpSecurityAttributes, dwFlags,
-				    lpScreenBufferData );
+  h = CreateConsoleScreenBuffer( dwDesiredAccess, dwShareMode,
+				 lpSecurityAttributes, dwFlags,
+				 lpScreenBufferData );
+  if (h != INVALID_HANDLE_VALUE)
+    forget_handle( h );
+  return h;
 }
 
-BOOL
-WINAPI MyCloseHandle( HANDLE hObject )
+// A handle is about to be closed: write anything pending for it and forget it.
+void closing_handle( HANDLE hObject )
 {
+  struct Handle* p = HANDLE_SLOT( hObject );
   int c;
 
+  // Most handles closed have nothing to do with the console, so don't lock
+  // unless it's one we know about.
+  for (c = 0; c < CONTEXTS; ++c)
+    if (parser[c].h == hObject)
+      break;
+  if (c == CONTEXTS && p->h != hObject && hObject != hConOut &&
+      hObject != hPending && hObject != grid_h)
+  {
+    ++stat_close_skip;
+    return;
+  }
+
   EnterCriticalSection( &CritSect );
 
-  FlushBuffer();
+  // Anything pending is for hConOut (or the grid), apart from the buffer
+  // (which is for hPending), so it's only needed if that's closing.
+  if (hObject == hConOut || hObject == grid_h)
+    FlushConsole();
+  else if (hObject == hPending)
+    FlushBuffer();
+  else
+    ++stat_close_skip;
 
-  for (c = 0; c < CACHE; ++c)
-    if (cache[c].h == hObject)
+  forget_handle( hObject );
+  for (c = 0; c < CONTEXTS; ++c)
+    if (parser[c].h == hObject)
     {
-      cache[c].h = INVALID_HANDLE_VALUE;
+      parser[c].h = INVALID_HANDLE_VALUE;
       break;
     }
 
   LeaveCriticalSection( &CritSect );
+}
 
+BOOL
+WINAPI MyCloseHandle( HANDLE hObject )
+{
+  closing_handle( hObject );
   return CloseHandle( hObject );
 }
 
+// DuplicateHandle can close the source, and gives a new handle (which could
+// have the value of one closed without CloseHandle).  Only handles of this
+// process matter, which is usually given as the pseudo handle.
+BOOL
+WINAPI MyDuplicateHandle( HANDLE hSourceProcessHandle, HANDLE hSourceHandle,
+			  HANDLE hTargetProcessHandle, LPHANDLE lpTargetHandle,
+			  DWORD dwDesiredAccess, BOOL bInheritHandle,
+			  DWORD dwOptions )
+{
+  BOOL rc;
+
+  // The source is closed even if it fails.
+  if ((dwOptions & DUPLICATE_CLOSE_SOURCE) &&
+      hSourceProcessHandle == GetCurrentProcess())
+    closing_handle( hSourceHandle );
+  rc = DuplicateHandle( hSourceProcessHandle, hSourceHandle,
+			hTargetProcessHandle, lpTargetHandle,
+			dwDesiredAccess, bInheritHandle, dwOptions );
+  if (rc && lpTargetHandle != NULL &&
+      hTargetProcessHandle == GetCurrentProcess())
+    forget_handle( *lpTargetHandle );
+  return rc;
+}
+
 
 //-----------------------------------------------------------------------------
 //   My...
@@ -3806,34 +5420,45 @@ WINAPI MyCloseHandle( HANDLE hObject )
 
 #define FLUSH2( func, arg2 ) \
   BOOL WINAPI My##func( HANDLE a1, arg2 a2 )\
-  { FlushBuffer(); return func( a1, a2 ); }
+  { FlushConsole(); return func( a1, a2 ); }
 
 #define FLUSH2X( func, arg2 ) \
   BOOL WINAPI My##func##Ex( HANDLE a1, arg2 a2 )\
-  { FlushBuffer(); return func##X( a1, a2 ); }
+  { FlushConsole(); return func##X( a1, a2 ); }
 
 #define FLUSH3( func, arg2, arg3 ) \
   BOOL WINAPI My##func( HANDLE a1, arg2 a2, arg3 a3 )\
-  { FlushBuffer(); return func( a1, a2, a3 ); }
+  { FlushConsole(); return func( a1, a2, a3 ); }
 
 #define FLUSH3X( func, arg2, arg3 ) \
   BOOL WINAPI My##func##Ex( HANDLE a1, arg2 a2, arg3 a3 )\
-  { FlushBuffer(); return func##X( a1, a2, a3 ); }
+  { FlushConsole(); return func##X( a1, a2, a3 ); }
+
+// As above, but the scratch buffer may need resizing, too.
+#define RESIZE2( func, arg2 ) \
+  BOOL WINAPI My##func( HANDLE a1, arg2 a2 )\
+  { FlushConsole(); wrap_size.X = 0; return func( a1, a2 ); }
+
+#define RESIZE2X( func, arg2 ) \
+  BOOL WINAPI My##func##Ex( HANDLE a1, arg2 a2 )\
+  { FlushConsole(); wrap_size.X = 0; nearest_valid = FALSE; \
+    return func##X( a1, a2 ); }
+
+#define RESIZE3( func, arg2, arg3 ) \
+  BOOL WINAPI My##func( HANDLE a1, arg2 a2, arg3 a3 )\
+  { FlushConsole(); wrap_size.X = 0; return func( a1, a2, a3 ); }
 
 #define FLUSH4( func, arg2, arg3, arg4 ) \
   BOOL WINAPI My##func( HANDLE a1, arg2 a2, arg3 a3, arg4 a4 )\
-  { FlushBuffer(); return func( a1, a2, a3, a4 ); }
+  { FlushConsole(); return func( a1, a2, a3, a4 ); }
 
 #define FLUSH5( func, arg2, arg3, arg4, arg5 ) \
   BOOL WINAPI My##func( HANDLE a1, arg2 a2, arg3 a3, arg4 a4, arg5 a5 )\
-  { FlushBuffer(); return func( a1, a2, a3, a4, a5 ); }
+  { FlushConsole(); return func( a1, a2, a3, a4, a5 ); }
 
 FLUSH5( FillConsoleOutputAttribute,  WORD, DWORD, COORD, LPDWORD )
 FLUSH5( FillConsoleOutputCharacterA, CHAR, DWORD, COORD, LPDWORD )
 FLUSH5( FillConsoleOutputCharacterW, WCHAR, DWORD, COORD, LPDWORD )
-FLUSH2( GetConsoleScreenBufferInfo,  PCONSOLE_SCREEN_BUFFER_INFO )
-FLUSH2X( GetConsoleScreenBufferInfo, PCONSOLE_SCREEN_BUFFER_INFOX )
-FLUSH5( ReadFile,     LPVOID, DWORD, LPDWORD, LPOVERLAPPED )
 FLUSH5( ReadConsoleA, LPVOID, DWORD, LPDWORD, LPVOID )
 FLUSH5( ReadConsoleW, LPVOID, DWORD, LPDWORD, LPVOID )
 FLUSH4( ReadConsoleInputA, PINPUT_RECORD, DWORD, LPDWORD )
@@ -3846,10 +5471,10 @@ FLUSH5( ReadConsoleOutputCharacterW, LPWSTR, DWORD, COORD, LPDWORD )
 FLUSH5( ScrollConsoleScreenBufferA, SMALL_RECT*,SMALL_RECT*, COORD, CHAR_INFO* )
 FLUSH5( ScrollConsoleScreenBufferW, SMALL_RECT*,SMALL_RECT*, COORD, CHAR_INFO* )
 FLUSH2( SetConsoleCursorPosition, COORD )
-FLUSH2X( SetConsoleScreenBufferInfo, PCONSOLE_SCREEN_BUFFER_INFOX )
-FLUSH2( SetConsoleScreenBufferSize, COORD )
+RESIZE2X( SetConsoleScreenBufferInfo, PCONSOLE_SCREEN_BUFFER_INFOX )
+RESIZE2( SetConsoleScreenBufferSize, COORD )
 FLUSH2( SetConsoleTextAttribute, WORD )
-FLUSH3( SetConsoleWindowInfo, BOOL, const SMALL_RECT* )
+RESIZE3( SetConsoleWindowInfo, BOOL, const SMALL_RECT* )
 FLUSH3X( SetCurrentConsoleFont, BOOL, PCONSOLE_FONT_INFOX )
 FLUSH5( WriteConsoleOutputA, const CHAR_INFO*, COORD, COORD, PSMALL_RECT )
 FLUSH5( WriteConsoleOutputW, const CHAR_INFO*, COORD, COORD, PSMALL_RECT )
@@ -3858,6 +5483,118 @@ FLUSH5( WriteConsoleOutputCharacterA, LPCSTR, DWORD, COORD, LPDWORD )
 FLUSH5( WriteConsoleOutputCharacterW, LPCWSTR, DWORD, COORD, LPDWORD )
 
 
+//-----------------------------------------------------------------------------
+//   model_info( HANDLE h, PCONSOLE_SCREEN_BUFFER_INFO pInfo )
+// Works out the console info as it will be once everything pending has been
+// written, so a query of the cursor needn't flush.  Returns FALSE if it can't
+// be done safely: it's a different handle, or the text could scroll, move the
+// window, or wrap uncertainly.
+//-----------------------------------------------------------------------------
+
+BOOL model_info( HANDLE h, PCONSOLE_SCREEN_BUFFER_INFO pInfo )
+{
+  CONSOLE_SCREEN_BUFFER_INFO Info;
+  int x, y;
+
+  if (h != hConOut || (nCharInBuffer > 0 && hPending != hConOut) ||
+      nLinesInBuffer)
+    return FALSE;
+
+  // The program is asking, so it may have changed something itself.
+  csbi_valid = FALSE;
+  if (!get_info( &Info ))
+    return FALSE;
+
+  if (nCharInBuffer > 0)
+  {
+    x = CUR.X;
+    y = CUR.Y;
+    if (im || pState->crm || pState->tb_margins ||
+	!tx_cursor( ChBuffer, nCharInBuffer, WIDTH,
+		    conmode & ENABLE_PROCESSED_OUTPUT, awm, conmode & 4,
+		    get_cells, &x, &y ))
+      return FALSE;
+    CUR.X = x;
+    CUR.Y = y;
+  }
+  // Writing and moving the cursor scroll the window to keep it visible.
+  if ((nCharInBuffer > 0 || pending_move) &&
+      (CUR.Y < TOP || CUR.Y > BOTTOM || CUR.X < WIN.Left || CUR.X > WIN.Right))
+    return FALSE;
+
+  *pInfo = Info;
+  return TRUE;
+}
+
+BOOL
+WINAPI MyGetConsoleScreenBufferInfo( HANDLE a1, PCONSOLE_SCREEN_BUFFER_INFO a2 )
+{
+  BOOL rc;
+
+  EnterCriticalSection( &CritSect );
+  if (model_info( a1, a2 ))
+  {
+    ++stat_query_model;
+    rc = TRUE;
+  }
+  else
+  {
+    FlushConsole();
+    rc = GetConsoleScreenBufferInfo( a1, a2 );
+  }
+  LeaveCriticalSection( &CritSect );
+  return rc;
+}
+
+BOOL
+WINAPI MyGetConsoleScreenBufferInfoEx( HANDLE a1,
+				       PCONSOLE_SCREEN_BUFFER_INFOX a2 )
+{
+  CONSOLE_SCREEN_BUFFER_INFO Info;
+  BOOL rc;
+
+  EnterCriticalSection( &CritSect );
+  if (model_info( a1, &Info ) && GetConsoleScreenBufferInfoX( a1, a2 ))
+  {
+    a2->dwCursorPosition = Info.dwCursorPosition;
+    a2->wAttributes = Info.wAttributes;
+    ++stat_query_model;
+    rc = TRUE;
+  }
+  else
+  {
+    FlushConsole();
+    rc = GetConsoleScreenBufferInfoX( a1, a2 );
+  }
+  LeaveCriticalSection( &CritSect );
+  return rc;
+}
+
+
+// Only a read from the console could be waiting on what's been written.  Most
+// reads are files with nothing written, so test that first (without locking,
+// since a write still going will finish before anything could read it), then
+// only ask of handles not known.  Reading the console, GetConsoleMode will
+// work, so there's no need to try writing (as handle_mode does).
+BOOL
+WINAPI MyReadFile( HANDLE hFile, LPVOID lpBuffer, DWORD nNumberOfBytesToRead,
+		   LPDWORD lpNumberOfBytesRead, LPOVERLAPPED lpOverlapped )
+{
+  DWORD mode;
+
+  if ((nCharInBuffer > 0 || pending_attr != -1 || pending_move ||
+       grid.dirty || writing) &&
+      (known_handle( hFile, &mode ) ? (mode & CON_HANDLE) :
+       (GetFileType( hFile ) == FILE_TYPE_CHAR &&
+	GetConsoleMode( hFile, &mode ))))
+    FlushConsole();
+  else
+    ++stat_read_skip;
+  return ReadFile( hFile, lpBuffer, nNumberOfBytesToRead, lpNumberOfBytesRead,
+		   lpOverlapped );
+}
+
+
 // ========== Environment variable
 
 void set_ansicon( PCONSOLE_SCREEN_BUFFER_INFO pcsbi )
@@ -3936,6 +5673,26 @@ WINAPI MyGetEnvironmentVariableW( LPCWSTR lpName, LPWSTR lpBuffer, DWORD nSize )
   return GetEnvironmentVariableW( lpName, lpBuffer, nSize );
 }
 
+BOOL
+WINAPI MySetEnvironmentVariableA( LPCSTR lpName, LPCSTR lpValue )
+{
+  BOOL rc = SetEnvironmentVariableA( lpName, lpValue );
+  InterlockedIncrement( &env_gen );
+  if (lstrcmpiA( lpName, "ANSICON_DEF" ) == 0)
+    def_attr_valid = FALSE;
+  return rc;
+}
+
+BOOL
+WINAPI MySetEnvironmentVariableW( LPCWSTR lpName, LPCWSTR lpValue )
+{
+  BOOL rc = SetEnvironmentVariableW( lpName, lpValue );
+  InterlockedIncrement( &env_gen );
+  if (lstrcmpi( lpName, L"ANSICON_DEF" ) == 0)
+    def_attr_valid = FALSE;
+  return rc;
+}
+
 
 // ========== Initialisation
 
@@ -3949,6 +5706,8 @@ HookFn Hooks[] = {
   HOOK( APIProcessThreads,     CreateProcessW ),
   HOOK( APIProcessEnvironment, GetEnvironmentVariableA ),
   HOOK( APIProcessEnvironment, GetEnvironmentVariableW ),
+  HOOK( APIProcessEnvironment, SetEnvironmentVariableA ),
+  HOOK( APIProcessEnvironment, SetEnvironmentVariableW ),
   HOOK( APILibraryLoader,      GetProcAddress ),
   HOOK( APILibraryLoader,      LoadLibraryExA ),
   HOOK( APILibraryLoader,      LoadLibraryExW ),
@@ -3963,6 +5722,7 @@ HookFn Hooks[] = {
   HOOK( APIFile,	       CreateFileW ),
   HOOK( APIConsole,	       CreateConsoleScreenBuffer ),
   HOOK( APIHandle,	       CloseHandle ),
+  HOOK( APIHandle,	       DuplicateHandle ),
   HOOK( APIConsole,	       FillConsoleOutputAttribute ),
   HOOK( APIConsole,	       FillConsoleOutputCharacterA ),
   HOOK( APIConsole,	       FillConsoleOutputCharacterW ),
@@ -4063,6 +5823,43 @@ DWORD WINAPI exit_thread( LPVOID lpParameter )
 }
 
 
+// Log the performance counters.
+void log_stats( void )
+{
+  DEBUGSTR( 1, "Console info: %u requested, %u queried",
+	    stat_info, stat_query );
+  DEBUGSTR( 1, "Wrap: %u predicted, %u tested",
+	    stat_wrap_predict, stat_wrap_test );
+  DEBUGSTR( 1, "Writes: %u in the background", stat_write_queued );
+  DEBUGSTR( 1, "Jump scroll: %u lines in %u scrolls",
+	    stat_jump_lines, stat_jump );
+  DEBUGSTR( 1, "Progress: %u lines rewritten in the buffer",
+	    stat_cr_coalesce );
+  DEBUGSTR( 1, "Handles: %u found, %u checked",
+	    stat_handle_hit, stat_handle_miss );
+  DEBUGSTR( 1, "Flushes avoided: %u ReadFile, %u CloseHandle, %u console info",
+	    stat_read_skip, stat_close_skip, stat_query_model );
+  DEBUGSTR( 1, "Colors: %u remembered, %u found, %u palette changes",
+	    stat_color_hit, stat_color_miss, stat_palette );
+  DEBUGSTR( 1, "Program lists: %u read, %u searched",
+	    stat_list_read, stat_list_search );
+  DEBUGSTR( 1, "Buffer: grown %u times, at most %u characters written at once",
+	    stat_buffer_grow, stat_flush_len );
+  DEBUGSTR( 1, "Flushes: %u control, %u full, %u newline, %u timer, "
+	       "%u hook, %u write, %u exit",
+	    stat_flush_why[FR_SEQ], stat_flush_why[FR_FULL],
+	    stat_flush_why[FR_NEWLINE], stat_flush_why[FR_TIMER],
+	    stat_flush_why[FR_HOOK], stat_flush_why[FR_WRITE],
+	    stat_flush_why[FR_EXIT] );
+  DEBUGSTR( 1, "Scratch buffer: %u created in %u flushes (%u per 1000)",
+	    stat_wrap_create, stat_flush,
+	    (stat_flush) ? stat_wrap_create * 1000 / stat_flush : 0 );
+  if (gm)
+    DEBUGSTR( 1, "Grid: %u read, %u flushed, %u rectangles written",
+	      stat_grid_read, stat_grid_flush, stat_grid_rect );
+}
+
+
 //-----------------------------------------------------------------------------
 //   DllMain()
 // Function called by the system when processes and threads are initialized
@@ -4081,6 +5878,7 @@ BOOL WINAPI DllMain( HINSTANCE hInstance, DWORD dwReason, LPVOID lpReserved )
   if (dwReason == DLL_PROCESS_ATTACH)
   {
     hHeap = HeapCreate( 0, 0, 256 * 1024 );
+    InitializeCriticalSection( &EnvSect );
     hKernel = GetModuleHandleA( APIKernel );
     GetConsoleScreenBufferInfoX = (PHCSBIX)GetProcAddress(
 				     hKernel, "GetConsoleScreenBufferInfoEx" );
@@ -4115,14 +5913,20 @@ BOOL WINAPI DllMain( HINSTANCE hInstance, DWORD dwReason, LPVOID lpReserved )
     bResult = HookAPIAllMod( Hooks, FALSE, FALSE );
     OriginalAttr( lpReserved );
 
-    if (search_env( L"ANSICON_WRAP", prog ))
+    if (search_env( ENV_WRAP, prog ))
       wm = TRUE;
+    if (search_env( ENV_GRID, prog ))
+      gm = TRUE;
+    get_flush_settings();
+    get_nearest_setting();
 
     NtQueryInformationThread = (PNTQIT)GetProcAddress(
 		 GetModuleHandle( L"ntdll.dll" ), "NtQueryInformationThread" );
 
     InitializeCriticalSection( &CritSect );
     hFlushTimer = CreateWaitableTimer( NULL, FALSE, NULL );
+    hWriteStart = CreateEvent( NULL, FALSE, FALSE, NULL );
+    hWriteDone	= CreateEvent( NULL, FALSE, FALSE, NULL );
 
     // If it's a static load, assume this is the primary thread.
     if (lpReserved)
@@ -4134,13 +5938,26 @@ BOOL WINAPI DllMain( HINSTANCE hInstance, DWORD dwReason, LPVOID lpReserved )
   else if (dwReason == DLL_PROCESS_DETACH)
   {
     CloseHandle( hFlushTimer );
-    FlushBuffer();
+    flush_why = FR_EXIT;
+    FlushConsole();
+    if (hConWrap != NULL)
+      CloseHandle( hConWrap );
+    if (log_level & 64)
+      log_stats();
     DeleteCriticalSection( &CritSect );
+    DeleteCriticalSection( &EnvSect );
     if (hFlush != NULL)
     {
       TerminateThread( hFlush, 0 );
       CloseHandle( hFlush );
     }
+    if (hWriter != NULL)
+    {
+      TerminateThread( hWriter, 0 );
+      CloseHandle( hWriter );
+    }
+    CloseHandle( hWriteStart );
+    CloseHandle( hWriteDone );
     if (lpReserved == NULL)
     {
       DEBUGSTR( 1, "Unloading" );
@@ -97,9 +97,12 @@
     use IsConsoleHandle for my_fputws, to distinguish NUL;
     don't load into the parent if already loaded;
     add log level 32 to log CreateFile.
+
+  v1.90, 17 October, 2026:
+    add log level 64 to log performance counters.
 */
 
-#define PDATE L"29 April, 2019"
+#define PDATE L"17 October, 2026"
 
 #include "ansicon.h"
 #include "version.h"
@@ -875,7 +878,8 @@ L"ansicon [-lLEVEL] [-i] [-I] [-u] [-U] [-m[ATTR]] [-p[u]]\n"
 L"        [-e|E STRING | -t|T [FILE...] | PROGRAM [ARGS]]\n"
 L"\n"
 L"  -l\t\tset the logging level (1=process, 2=module, 3=function,\n"
-L"    \t\t +4=output, +8=append, +16=imports, +32=files) for PROGRAM\n"
+L"    \t\t +4=output, +8=append, +16=imports, +32=files, +64=stats)\n"
+L"    \t\t for PROGRAM\n"
 L"  -i\t\tinstall - add ANSICON to CMD's AutoRun entry (also implies -p)\n"
 L"  -u\t\tuninstall - remove ANSICON from the AutoRun entry\n"
 L"  -I -U\t\tuse local machine instead of current user\n"
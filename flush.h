@@ -0,0 +1,67 @@
+/*
+  flush.h - When to write the output that's been collected.
+
+  Used by ANSI.c.  Output after a pause is probably interactive, so it's shown
+  straight away; a steady stream is left a little longer each time, to write
+  more at once.  Once output is waiting, the time it will be written by is set
+  and isn't put off by more output.  There's nothing Windows-specific here, so
+  it can be tested elsewhere (see tests/flush_test.c).
+*/
+
+#ifndef FLUSH_H
+#define FLUSH_H
+
+typedef struct
+{
+  unsigned long min, max;	// shortest & longest delay (milliseconds)
+  unsigned long delay;		// current delay (0 to flush straight away)
+  unsigned long last;		// tick count of the previous write
+  unsigned long start, wait;	// when the flush was set and its delay
+  int		armed;		// a flush is set and hasn't happened
+} FLUSH;
+
+enum
+{
+  FL_NOW,			// write it now
+  FL_ARM,			// set the timer for f->wait
+  FL_WAIT			// leave it to the timer already set
+};
+
+// A write has finished at tick NOW, leaving output to write.  IMMEDIATE if
+// the handle wants everything written; HELD if the output shouldn't be
+// written yet (it ends in CR, so may yet be overwritten).
+static int fl_write( FLUSH* f, unsigned long now, int immediate, int held )
+{
+  if (now - f->last >= f->max)
+    f->delay = 0;
+  else if (f->delay < f->min)
+    f->delay = f->min;
+  else if ((f->delay *= 2) > f->max)
+    f->delay = f->max;
+  f->last = now;
+
+  if (f->armed)
+  {
+    // The timer has gone off, but its thread is still waiting its turn.
+    if (now - f->start >= f->wait)
+      return FL_NOW;
+    if (!immediate || held)
+      return FL_WAIT;
+  }
+  if ((immediate || f->delay == 0) && !held)
+    return FL_NOW;
+
+  f->start = now;
+  f->wait  = (f->delay) ? f->delay : f->min;
+  f->armed = 1;
+  return FL_ARM;
+}
+
+
+// The timer has gone off.
+static void fl_fired( FLUSH* f )
+{
+  f->armed = 0;
+}
+
+#endif
@@ -0,0 +1,300 @@
+/*
+  grid.h - A copy of the console window, noting the lines that change.
+
+  Used by ANSI.c for ANSICON_GRID.  There's nothing Windows-specific here, so
+  it can be tested elsewhere (see tests/grid_test.c).
+*/
+
+#ifndef GRID_H
+#define GRID_H
+
+// A cell, the same as CHAR_INFO.
+typedef struct
+{
+  unsigned short ch;
+  unsigned short attr;
+} GCELL;
+
+// A rectangle (inclusive), the same as SMALL_RECT.
+typedef struct
+{
+  short left, top, right, bottom;
+} GRECT;
+
+typedef struct
+{
+  GCELL* cell;			// cells of the window
+  short* lo, * hi;		// columns changed on each line
+  int	 top, width, rows;	// buffer line of the first line, size
+  int	 dirty; 		// something needs to be written
+} GRID;
+
+#define GCELL_AT( g, y, x ) ((g)->cell + ((y) - (g)->top) * (g)->width + (x))
+
+// Bytes needed for the cells and changes of a grid.
+#define GRID_SIZE( width, rows ) \
+  ((width) * (rows) * sizeof(GCELL) + 2 * (rows) * sizeof(short))
+
+
+// Use MEM (of GRID_SIZE bytes) for the grid, with nothing changed.  The cells
+// are left for the caller to read.
+static void gr_init( GRID* g, void* mem, int top, int width, int rows )
+{
+  int i;
+
+  g->cell  = mem;
+  g->lo    = (short*)(g->cell + width * rows);
+  g->hi    = g->lo + rows;
+  g->top   = top;
+  g->width = width;
+  g->rows  = rows;
+  g->dirty = 0;
+  for (i = 0; i < rows; ++i)
+  {
+    g->lo[i] = width;
+    g->hi[i] = -1;
+  }
+}
+
+
+// Note that cells x0 to x1 of line y have changed.
+static void gr_changed( GRID* g, int y, int x0, int x1 )
+{
+  y -= g->top;
+  if (x0 < g->lo[y]) g->lo[y] = x0;
+  if (x1 > g->hi[y]) g->hi[y] = x1;
+  g->dirty = 1;
+}
+
+
+// Set cells x0 to x1 of line y.
+static void gr_blank( GRID* g, int y, int x0, int x1, const GCELL* fill )
+{
+  GCELL* p = GCELL_AT( g, y, x0 );
+  int	 n;
+
+  gr_changed( g, y, x0, x1 );
+  for (n = x1 - x0 + 1; n > 0; --n)
+    *p++ = *fill;
+}
+
+
+// Set LEN cells from (x,y), continuing on the following lines (as
+// FillConsoleOutput*).  Returns 0 if they aren't all in the grid.
+static int gr_fill( GRID* g, unsigned long len, int x, int y,
+		    const GCELL* fill )
+{
+  unsigned long n;
+
+  if (y < g->top || x < 0 || x >= g->width ||
+      (unsigned long)((y - g->top) * g->width + x) + len >
+	(unsigned long)(g->rows * g->width))
+    return 0;
+
+  while (len > 0)
+  {
+    n = g->width - x;
+    if (n > len)
+      n = len;
+    gr_blank( g, y, x, x + (int)n - 1, fill );
+    len -= n;
+    ++y;
+    x = 0;
+  }
+  return 1;
+}
+
+
+// Reduce r to the part also in a; return 0 if there is none.
+static int gr_clip( GRECT* r, const GRECT* a )
+{
+  if (r->left	< a->left)   r->left   = a->left;
+  if (r->top	< a->top)    r->top    = a->top;
+  if (r->right	> a->right)  r->right  = a->right;
+  if (r->bottom > a->bottom) r->bottom = a->bottom;
+  return (r->left <= r->right && r->top <= r->bottom);
+}
+
+
+// Move RECT to (x,y), filling what's left behind, changing only what's in CLIP
+// (as ScrollConsoleScreenBuffer, but the clip is required).  Returns 0 if the
+// source or what changes isn't in the grid.
+static int gr_scroll( GRID* g, const GRECT* rect, const GRECT* clip,
+		      int x, int y, const GCELL* fill )
+{
+  GRECT gr, s, c, d, sc, dc, t;
+  int	dx, dy, y1, step;
+
+  gr.left   = 0;
+  gr.right  = g->width - 1;
+  gr.top    = g->top;
+  gr.bottom = g->top + g->rows - 1;
+  s = *rect;
+  c = *clip;
+  dx = x - s.left;
+  dy = y - s.top;
+  d.left   = x;
+  d.top    = y;
+  d.right  = s.right + dx;
+  d.bottom = s.bottom + dy;
+  sc = s;
+  dc = d;
+
+  // The source has to be entirely in the grid (even the part that's clipped,
+  // since it may be copied), as does whatever gets changed.
+  if (!gr_clip( &sc, &gr ) ||
+      sc.left != s.left || sc.right != s.right ||
+      sc.top != s.top || sc.bottom != s.bottom)
+    return 0;
+  if (gr_clip( &dc, &c ))
+  {
+    t = dc;
+    if (!gr_clip( &t, &gr ) ||
+	t.left != dc.left || t.right != dc.right ||
+	t.top != dc.top || t.bottom != dc.bottom)
+      return 0;
+    // Go against the direction of movement, so nothing is overwritten
+    // before it's copied.
+    if (dy > 0)
+    {
+      y = dc.bottom;
+      y1 = dc.top - 1;
+      step = -1;
+    }
+    else
+    {
+      y = dc.top;
+      y1 = dc.bottom + 1;
+      step = 1;
+    }
+    for (; y != y1; y += step)
+    {
+      GCELL* to   = GCELL_AT( g, y, dc.left );
+      GCELL* from = GCELL_AT( g, y - dy, dc.left - dx );
+      int    n	  = dc.right - dc.left + 1;
+      // Overlaps on the same line, so copy against the direction, too.
+      if (dx > 0)
+	while (--n >= 0)
+	  to[n] = from[n];
+      else
+	for (x = 0; x < n; ++x)
+	  to[x] = from[x];
+      gr_changed( g, y, dc.left, dc.right );
+    }
+  }
+  else
+    dc.top = dc.bottom + 1;	// nothing copied
+
+  // Fill what's left of the source.
+  if (gr_clip( &sc, &c ))
+  {
+    for (y = sc.top; y <= sc.bottom; ++y)
+    {
+      if (y < dc.top || y > dc.bottom || dc.left > sc.right ||
+	  dc.right < sc.left)
+	gr_blank( g, y, sc.left, sc.right, fill );
+      else
+      {
+	if (sc.left < dc.left)
+	  gr_blank( g, y, sc.left, dc.left - 1, fill );
+	if (sc.right > dc.right)
+	  gr_blank( g, y, dc.right + 1, sc.right, fill );
+      }
+    }
+  }
+  return 1;
+}
+
+
+// Put text at (x,y) in ATTR.  CR and BS are the only controls allowed (and
+// only if PROCESSED), and the text must stay on the line (wrapping is left to
+// the console).  Each character is taken to be one cell (the caller checks).
+// Returns the new column, or -1 if it can't be done.
+static int gr_text( GRID* g, int x, int y, const unsigned short* text, int len,
+		    int processed, unsigned short attr )
+{
+  GCELL* p;
+  int	 i, x0, lo, hi;
+  unsigned short c;
+
+  if (y < g->top || y >= g->top + g->rows)
+    return -1;
+
+  x0 = x;
+  for (i = 0; i < len; ++i)
+  {
+    c = text[i];
+    if (c < ' ')
+    {
+      if (!processed)
+	return -1;
+      if (c == '\r')
+	x = 0;
+      else if (c == '\b' && x > 0)
+	--x;
+      else
+	return -1;
+    }
+    else if (++x >= g->width)
+      return -1;
+  }
+
+  p  = GCELL_AT( g, y, 0 );
+  x  = x0;
+  lo = g->width;
+  hi = -1;
+  for (i = 0; i < len; ++i)
+  {
+    c = text[i];
+    if (c == '\r')
+      x = 0;
+    else if (c == '\b')
+      --x;
+    else
+    {
+      if (x < lo) lo = x;
+      if (x > hi) hi = x;
+      p[x].ch	= c;
+      p[x].attr = attr;
+      ++x;
+    }
+  }
+  if (hi >= 0)
+    gr_changed( g, y, lo, hi );
+  return x;
+}
+
+
+// Find the next lines that have changed, from line *row (of the grid), joining
+// adjacent lines into one rectangle (R, in grid lines).  The lines are marked
+// as unchanged and *row set after them.  Returns 0 when there are no more.
+static int gr_next_rect( GRID* g, int* row, GRECT* r )
+{
+  int y, end;
+
+  for (y = *row; y < g->rows && g->lo[y] > g->hi[y]; ++y) ;
+  if (y == g->rows)
+  {
+    *row = y;
+    g->dirty = 0;
+    return 0;
+  }
+  r->top   = y;
+  r->left  = g->lo[y];
+  r->right = g->hi[y];
+  for (end = y + 1; end < g->rows && g->lo[end] <= g->hi[end]; ++end)
+  {
+    if (g->lo[end] < r->left)  r->left  = g->lo[end];
+    if (g->hi[end] > r->right) r->right = g->hi[end];
+  }
+  r->bottom = end - 1;
+  for (; y < end; ++y)
+  {
+    g->lo[y] = g->width;
+    g->hi[y] = -1;
+  }
+  *row = end;
+  return 1;
+}
+
+#endif
@@ -0,0 +1,154 @@
+/*
+  parse.h - The escape sequence parser's tables.
+
+  Used by ANSI.c (see ParseString): each character is classified and the
+  action for that class in the current state is performed.  There's nothing
+  Windows-specific here, so it can be tested elsewhere (see tests/parse_test.c,
+  which compares it to the parser it replaced).
+*/
+
+#ifndef PARSE_H
+#define PARSE_H
+
+// Character classes.  Anything above ASCII is printable.
+#define CL_PRINT   0		// printable (and anything not listed below)
+#define CL_CTRL    1		// other C0 controls
+#define CL_BEL	   2
+#define CL_ESC	   3
+#define CL_SO	   4
+#define CL_SI	   5
+#define CL_HT	   6
+#define CL_FMT	   7		// BS, LF & CR (special in insert mode)
+#define CL_INTER   8		// intermediate byte (space to '/')
+#define CL_DIGIT   9
+#define CL_COLON  10
+#define CL_SEMI   11
+#define CL_PRIV   12		// private parameter ('<' to '?')
+#define CL_CSI	  13		// '['
+#define CL_OSC	  14		// ']'
+#define CL_STR	  15		// 'P', 'X', '^' & '_' (DCS, SOS, PM & APC)
+#define CL_ST	  16		// '\\' (the end of ST)
+#define CLASSES   17
+
+static const unsigned char char_class[128] =
+{
+  CL_CTRL,  CL_CTRL,  CL_CTRL,  CL_CTRL,  CL_CTRL,  CL_CTRL,  CL_CTRL,  CL_BEL,
+  CL_FMT,   CL_HT,    CL_FMT,   CL_CTRL,  CL_CTRL,  CL_FMT,   CL_SO,    CL_SI,
+  CL_CTRL,  CL_CTRL,  CL_CTRL,  CL_CTRL,  CL_CTRL,  CL_CTRL,  CL_CTRL,  CL_CTRL,
+  CL_CTRL,  CL_CTRL,  CL_CTRL,  CL_ESC,   CL_CTRL,  CL_CTRL,  CL_CTRL,  CL_CTRL,
+  CL_INTER, CL_INTER, CL_INTER, CL_INTER, CL_INTER, CL_INTER, CL_INTER, CL_INTER,
+  CL_INTER, CL_INTER, CL_INTER, CL_INTER, CL_INTER, CL_INTER, CL_INTER, CL_INTER,
+  CL_DIGIT, CL_DIGIT, CL_DIGIT, CL_DIGIT, CL_DIGIT, CL_DIGIT, CL_DIGIT, CL_DIGIT,
+  CL_DIGIT, CL_DIGIT, CL_COLON, CL_SEMI,  CL_PRIV,  CL_PRIV,  CL_PRIV,  CL_PRIV,
+  CL_PRINT, CL_PRINT, CL_PRINT, CL_PRINT, CL_PRINT, CL_PRINT, CL_PRINT, CL_PRINT,
+  CL_PRINT, CL_PRINT, CL_PRINT, CL_PRINT, CL_PRINT, CL_PRINT, CL_PRINT, CL_PRINT,
+  CL_STR,   CL_PRINT, CL_PRINT, CL_PRINT, CL_PRINT, CL_PRINT, CL_PRINT, CL_PRINT,
+  CL_STR,   CL_PRINT, CL_PRINT, CL_CSI,   CL_ST,    CL_OSC,   CL_STR,   CL_STR,
+  CL_PRINT, CL_PRINT, CL_PRINT, CL_PRINT, CL_PRINT, CL_PRINT, CL_PRINT, CL_PRINT,
+  CL_PRINT, CL_PRINT, CL_PRINT, CL_PRINT, CL_PRINT, CL_PRINT, CL_PRINT, CL_PRINT,
+  CL_PRINT, CL_PRINT, CL_PRINT, CL_PRINT, CL_PRINT, CL_PRINT, CL_PRINT, CL_PRINT,
+  CL_PRINT, CL_PRINT, CL_PRINT, CL_PRINT, CL_PRINT, CL_PRINT, CL_PRINT, CL_PRINT,
+};
+
+// Parser states.
+#define S_GROUND   0		// normal text
+#define S_ESC	   1		// ESC
+#define S_ESC_INT  2		// ESC with intermediate byte(s)
+#define S_CSI	   3		// ESC[ or ESC]
+#define S_PARAM    4		// ESC[ or ESC] with parameters
+#define S_OSC_STR  5		// OSC text
+#define S_STR	   6		// DCS/SOS/PM/APC string (ignored)
+#define S_CRM_ESC  7		// ESC during CRM
+#define S_CRM_CSI  8		// ESC[ during CRM
+#define S_CRM_3    9		// ESC[3 during CRM
+#define STATES	  10
+
+// Parser actions.
+#define A_NONE		 0
+#define A_PRINT 	 1	// add the character to the buffer
+#define A_BEL		 2
+#define A_ESC		 3	// start an escape sequence
+#define A_SO		 4
+#define A_SI		 5
+#define A_HT		 6
+#define A_FMT		 7	// BS, LF & CR
+#define A_CONTROL	 8	// display a control character (ESC + control)
+#define A_INTER 	 9	// collect an intermediate byte
+#define A_SCS		10	// escape sequence with intermediate byte(s)
+#define A_ESC_FINAL	11	// escape sequence
+#define A_CSI		12	// start CSI/OSC
+#define A_STRING	13	// start DCS/SOS/PM/APC
+#define A_FIRST_ARG	14	// first digit of the first parameter
+#define A_FIRST_SEP	15	// separator without a first parameter
+#define A_PRIVATE	16	// collect the secondary prefix
+#define A_CSI_FINAL	17	// control sequence without parameters
+#define A_ARG		18	// collect a parameter digit
+#define A_SEP		19	// next parameter
+#define A_FINAL 	20	// control sequence with parameters
+#define A_OSC_PUT	21	// collect OSC text
+#define A_OSC_END	22	// OSC terminated by BEL
+#define A_OSC_ST	23	// OSC text or ST
+#define A_STR_PUT	24	// remember the string character
+#define A_STR_END	25	// string terminated by BEL
+#define A_STR_ST	26	// string character or ST
+#define A_CRM		27	// recognising RM 3 during CRM
+
+// The action for each state and character class.
+static const unsigned char parse_table[STATES][CLASSES] =
+{
+  // PRINT	CTRL	     BEL	  ESC	       SO	    SI
+  // HT 	FMT	     INTER	  DIGIT        COLON	    SEMI
+  // PRIV	CSI	     OSC	  STR	       ST
+  { // S_GROUND
+    A_PRINT,	 A_PRINT,     A_BEL,	   A_ESC,	A_SO,	     A_SI,
+    A_HT,	 A_FMT,       A_PRINT,	   A_PRINT,	A_PRINT,     A_PRINT,
+    A_PRINT,	 A_PRINT,     A_PRINT,	   A_PRINT,	A_PRINT
+  },
+  { // S_ESC
+    A_ESC_FINAL, A_CONTROL,   A_CONTROL,   A_CONTROL,	A_CONTROL,   A_CONTROL,
+    A_CONTROL,	 A_CONTROL,   A_INTER,	   A_ESC_FINAL, A_ESC_FINAL, A_ESC_FINAL,
+    A_ESC_FINAL, A_CSI,       A_CSI,	   A_STRING,	A_ESC_FINAL
+  },
+  { // S_ESC_INT
+    A_SCS,	 A_CONTROL,   A_CONTROL,   A_CONTROL,	A_CONTROL,   A_CONTROL,
+    A_CONTROL,	 A_CONTROL,   A_INTER,	   A_SCS,	A_SCS,	     A_SCS,
+    A_SCS,	 A_SCS,       A_SCS,	   A_SCS,	A_SCS
+  },
+  { // S_CSI
+    A_CSI_FINAL, A_CSI_FINAL, A_CSI_FINAL, A_CSI_FINAL, A_CSI_FINAL, A_CSI_FINAL,
+    A_CSI_FINAL, A_CSI_FINAL, A_INTER,	   A_FIRST_ARG, A_NONE,      A_FIRST_SEP,
+    A_PRIVATE,	 A_CSI_FINAL, A_CSI_FINAL, A_CSI_FINAL, A_CSI_FINAL
+  },
+  { // S_PARAM
+    A_FINAL,	 A_FINAL,     A_FINAL,	   A_FINAL,	A_FINAL,     A_FINAL,
+    A_FINAL,	 A_FINAL,     A_INTER,	   A_ARG,	A_NONE,      A_SEP,
+    A_NONE,	 A_FINAL,     A_FINAL,	   A_FINAL,	A_FINAL
+  },
+  { // S_OSC_STR
+    A_OSC_PUT,	 A_OSC_PUT,   A_OSC_END,   A_OSC_PUT,	A_OSC_PUT,   A_OSC_PUT,
+    A_OSC_PUT,	 A_OSC_PUT,   A_OSC_PUT,   A_OSC_PUT,	A_OSC_PUT,   A_OSC_PUT,
+    A_OSC_PUT,	 A_OSC_PUT,   A_OSC_PUT,   A_OSC_PUT,	A_OSC_ST
+  },
+  { // S_STR
+    A_STR_PUT,	 A_STR_PUT,   A_STR_END,   A_STR_PUT,	A_STR_PUT,   A_STR_PUT,
+    A_STR_PUT,	 A_STR_PUT,   A_STR_PUT,   A_STR_PUT,	A_STR_PUT,   A_STR_PUT,
+    A_STR_PUT,	 A_STR_PUT,   A_STR_PUT,   A_STR_PUT,	A_STR_ST
+  },
+  { // S_CRM_ESC
+    A_CRM,	 A_CRM,       A_CRM,	   A_CRM,	A_CRM,	     A_CRM,
+    A_CRM,	 A_CRM,       A_CRM,	   A_CRM,	A_CRM,	     A_CRM,
+    A_CRM,	 A_CRM,       A_CRM,	   A_CRM,	A_CRM
+  },
+  { // S_CRM_CSI
+    A_CRM,	 A_CRM,       A_CRM,	   A_CRM,	A_CRM,	     A_CRM,
+    A_CRM,	 A_CRM,       A_CRM,	   A_CRM,	A_CRM,	     A_CRM,
+    A_CRM,	 A_CRM,       A_CRM,	   A_CRM,	A_CRM
+  },
+  { // S_CRM_3
+    A_CRM,	 A_CRM,       A_CRM,	   A_CRM,	A_CRM,	     A_CRM,
+    A_CRM,	 A_CRM,       A_CRM,	   A_CRM,	A_CRM,	     A_CRM,
+    A_CRM,	 A_CRM,       A_CRM,	   A_CRM,	A_CRM
+  },
+};
+
+#endif
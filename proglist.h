@@ -0,0 +1,165 @@
+/*
+  proglist.h - Find a name in a list of names (as ANSICON_API, ANSICON_EXC,
+	       etc.), ignoring case.
+
+  Used by ANSI.c.  Names that are only ASCII are hashed, with their letters
+  folded, so a search needn't compare every one; the comparison itself
+  (lstrcmpi) is left to the caller, so the names match just as before.  Names
+  that aren't ASCII (and searches for them) compare each name, since lstrcmpi
+  may equate what folding doesn't.  There's nothing Windows-
+  specific here, so it can be tested elsewhere (see tests/proglist_test.c).
+*/
+
+#ifndef PROGLIST_H
+#define PROGLIST_H
+
+// Compare two names, returning 0 if they're the same.
+typedef int (*PLCMP)( const unsigned short* a, const unsigned short* b );
+
+typedef struct
+{
+  long		   gen; 	// generation it was split (0 if never)
+  int		   not; 	// the names are excluded
+  unsigned short*  names;	// the names, each ending in NUL
+  unsigned short*  end; 	// after the last
+  unsigned short** slot;	// hash table of the ASCII names (NULL for none)
+  unsigned long    mask;	// size of the table less one
+  int		   other;	// some names are not ASCII
+} PLIST;
+
+
+// Hash a name (FNV-1a), folding ASCII letters; *ASCII is set if that's all it
+// is.
+static unsigned long pl_hash_name( const unsigned short* name, int* ascii )
+{
+  unsigned long h = 2166136261U;
+  unsigned short c;
+
+  *ascii = 1;
+  while ((c = *name++) != '\0')
+  {
+    if (c >= 0x80)
+      *ascii = 0;
+    else if (c >= 'A' && c <= 'Z')
+      c += 'a' - 'A';
+    h ^= c;
+    h = (h * 16777619) & 0xFFFFFFFF;
+  }
+  return h;
+}
+
+
+static unsigned short* pl_next( unsigned short* name )
+{
+  while (*name++ != '\0') ;
+  return name;
+}
+
+
+// Split VALUE (the variable's value, which is modified and must remain) into
+// its names, as generation GEN.  VALUE may be NULL for no variable.  Returns
+// the number of slots the hash table needs (0 for none).
+static unsigned long pl_split( PLIST* l, unsigned short* value, long gen )
+{
+  unsigned short* p;
+  unsigned long   cnt, size;
+
+  l->gen   = gen;
+  l->not   = (value != NULL && *value == '!');
+  l->names = l->end = NULL;
+  l->slot  = NULL;
+  l->mask  = 0;
+  l->other = 0;
+  if (value == NULL)
+    return 0;
+
+  l->names = value + l->not;
+  cnt = 0;
+  for (p = l->names; *p != '\0'; ++p)
+  {
+    if (*p == ';')
+      *p = '\0';
+    else if (p == l->names || p[-1] == '\0')
+      ++cnt;
+  }
+  l->end = p;
+  if (cnt == 0)
+    return 0;
+  for (size = 4; size < 2 * cnt; size <<= 1) ;
+  return size;
+}
+
+
+// Hash the names into SLOT (of the SIZE returned by pl_split).  If this isn't
+// done (there's no memory), every name is compared.
+static void pl_hash( PLIST* l, unsigned short** slot, unsigned long size )
+{
+  unsigned short* name;
+  unsigned long i;
+  int ascii;
+
+  for (i = 0; i < size; ++i)
+    slot[i] = NULL;
+  l->slot = slot;
+  l->mask = size - 1;
+  for (name = l->names; name < l->end; name = pl_next( name ))
+  {
+    if (*name == '\0')
+      continue;
+    i = pl_hash_name( name, &ascii ) & l->mask;
+    if (!ascii)
+    {
+      l->other = 1;
+      continue;
+    }
+    while (l->slot[i] != NULL)
+      i = (i + 1) & l->mask;
+    l->slot[i] = name;
+  }
+}
+
+
+// Determine if VAL is in the list (or not, if the names are excluded).
+static int pl_find( const PLIST* l, const unsigned short* val, PLCMP cmp )
+{
+  unsigned short* name;
+  unsigned long i;
+  int ascii, hashed, found = 0;
+
+  i = pl_hash_name( val, &ascii );
+  hashed = (l->slot != NULL && ascii);
+  if (hashed)
+  {
+    for (i &= l->mask; l->slot[i] != NULL; i = (i + 1) & l->mask)
+    {
+      if (cmp( l->slot[i], val ) == 0)
+      {
+	found = 1;
+	break;
+      }
+    }
+    if (found || !l->other)
+      return found ^ l->not;
+  }
+
+  // Compare the names not hashed (or all of them).
+  for (name = l->names; name < l->end; name = pl_next( name ))
+  {
+    if (*name == '\0')
+      continue;
+    if (hashed)
+    {
+      pl_hash_name( name, &ascii );
+      if (ascii)
+	continue;
+    }
+    if (cmp( name, val ) == 0)
+    {
+      found = 1;
+      break;
+    }
+  }
+  return found ^ l->not;
+}
+
+#endif
@@ -0,0 +1,122 @@
+/*
+  scroll.h - Moving the cursor a number of lines, scrolling at the margins.
+
+  Used by ANSI.c (MoveDown, MoveUp and scroll_lines) to move several lines at
+  once, scrolling whatever's left with one call.  There's nothing Windows-
+  specific here, so it can be tested elsewhere (see tests/scroll_test.c).
+*/
+
+#ifndef SCROLL_H
+#define SCROLL_H
+
+// The rows of the buffer that matter to moving the cursor.
+typedef struct
+{
+  int margins;			// the margins are set
+  int top, bottom;		// the margins (as buffer rows)
+  int win_top, win_bottom;	// the window
+  int last;			// the last row of the buffer
+} SCAREA;
+
+// Where a move leaves the cursor, and what it scrolls.
+typedef struct
+{
+  int y;			// the cursor's row
+  int n;			// lines to scroll (up if positive, 0 for none)
+  int top, bottom;		// the lines scrolled
+} SCMOVE;
+
+// What scrolling lines does.
+typedef struct
+{
+  int from, to; 		// the lines moved (none if FROM > TO)
+  int dest;			// where the first one goes
+  int clear, count;		// the lines to clear (COUNT of them from CLEAR)
+} SCSCROLL;
+
+
+// Move down N lines from row Y, scrolling at the bottom (margin).  The cursor
+// stays on the line where it scrolls, so whatever's left is scrolled at once.
+static void sc_down( const SCAREA* a, int y, int n, SCMOVE* m )
+{
+  m->n = 0;
+  for (; n > 0; --n)
+  {
+    if (a->margins && y == a->bottom)
+    {
+      m->n = n;
+      m->top = a->top;
+      m->bottom = a->bottom;
+      break;
+    }
+    if (a->margins && y == a->win_bottom)
+      break;
+    if (y == a->last)
+    {
+      m->n = n;
+      m->top = 0;
+      m->bottom = a->last;
+      break;
+    }
+    ++y;
+  }
+  m->y = y;
+}
+
+
+// Move up N lines from row Y, scrolling at the top (margin).
+static void sc_up( const SCAREA* a, int y, int n, SCMOVE* m )
+{
+  m->n = 0;
+  for (; n > 0; --n)
+  {
+    if (a->margins && y == a->top)
+    {
+      m->n = -n;
+      m->top = a->top;
+      m->bottom = a->bottom;
+      break;
+    }
+    if (a->margins && y == a->win_top)
+      break;
+    if (y == 0)
+    {
+      m->n = -n;
+      m->top = 0;
+      m->bottom = a->last;
+      break;
+    }
+    --y;
+  }
+  m->y = y;
+}
+
+
+// Scroll lines TOP to BOTTOM by N (up if positive, down if negative).  If it's
+// more than half, the lines that are neither moved nor vacated need clearing,
+// too; if it's all of them, they're all cleared.
+static void sc_scroll( int top, int bottom, int n, SCSCROLL* s )
+{
+  int h = bottom - top + 1;
+  int up = (n > 0);
+
+  if (!up) n = -n;
+  if (n < h)
+  {
+    s->from  = (up) ? top + n : top;
+    s->to    = (up) ? bottom : bottom - n;
+    s->dest  = (up) ? top : top + n;
+    s->clear = bottom + 1 - n;
+    s->count = 2 * n - h;
+  }
+  else
+  {
+    s->from  = 1;
+    s->to    = 0;
+    s->dest  = top;
+    s->clear = top;
+    s->count = h;
+  }
+}
+
+#endif
@@ -0,0 +1,195 @@
+/*
+  flush_test.c - Test when collected output is written (flush.h).
+
+  Writes are made every so many ticks, as ANSI.c would call fl_write, with the
+  timer going off (as FlushThread) when it's due.  No output may wait longer
+  than the longest delay, however often it's written.  That includes progress
+  lines rewritten using CR, where only the last line is kept between flushes
+  (see coalesce_cr in ANSI.c) and a line ending in CR is held for the timer.
+
+  Build and run with "make" in this directory.
+*/
+
+#include <stdio.h>
+#include "../flush.h"
+
+#define MIN  15
+#define MAX  60
+
+int failures;
+
+FLUSH	      f;
+unsigned long now;
+int	      pending;		// output is waiting to be written
+unsigned long since;		// when it started waiting
+unsigned long worst;		// longest it waited
+int	      flushes;
+
+#define STEPS 5000
+int	      line;		// progress step in the buffer
+int	      shown;		// progress step on the screen
+unsigned long step_time[STEPS+1]; // when each step was written
+
+
+void write_out( void )
+{
+  if (pending && now - since > worst)
+    worst = now - since;
+  pending = 0;
+  ++flushes;
+
+  // Everything up to the line in the buffer is now visible.
+  for (; shown < line; ++shown)
+    if (now - step_time[shown+1] > worst)
+      worst = now - step_time[shown+1];
+}
+
+
+void tick( void )
+{
+  ++now;
+  if (f.armed && now - f.start >= f.wait)
+  {
+    fl_fired( &f );
+    write_out();
+  }
+}
+
+
+// Start again, after a pause.
+void reset( void )
+{
+  f.min   = MIN;
+  f.max   = MAX;
+  f.delay = 0;
+  f.last  = 0;
+  f.armed = 0;
+  now	  = 1000;
+  pending = 0;
+  worst   = 0;
+  flushes = 0;
+  line	  = 0;
+  shown   = 0;
+}
+
+
+void do_write( int immediate, int held )
+{
+  if (!pending)
+  {
+    pending = 1;
+    since = now;
+  }
+  if (fl_write( &f, now, immediate, held ) == FL_NOW)
+    write_out();
+}
+
+
+// Write every PERIOD ticks, COUNT times, then wait for the timer.
+void stream( unsigned long period, int count, int immediate, int held )
+{
+  unsigned long t;
+
+  while (--count >= 0)
+  {
+    do_write( immediate, held );
+    for (t = 0; t < period; ++t)
+      tick();
+  }
+  for (t = 0; t <= MAX; ++t)
+    tick();
+}
+
+
+// A progress line every PERIOD ticks, written as "\rtext" or "text\r" (the
+// write ends in CR, so is held).
+void progress( unsigned long period, int held )
+{
+  unsigned long t;
+  int n;
+
+  for (n = 1; n <= STEPS; ++n)
+  {
+    line = n;
+    step_time[n] = now;
+    do_write( 0, held );
+    for (t = 0; t < period; ++t)
+      tick();
+  }
+  for (t = 0; t <= MAX; ++t)
+    tick();
+}
+
+
+void check( const char* name, int ok )
+{
+  if (!ok)
+  {
+    printf( "FAIL: %s (waited %lu, %d flushes)\n", name, worst, flushes );
+    ++failures;
+  }
+}
+
+
+int main( void )
+{
+  unsigned long period;
+
+  reset();
+  do_write( 0, 0 );
+  check( "after a pause", flushes == 1 && worst == 0 );
+
+  reset();
+  stream( 1000, 5, 0, 0 );
+  check( "occasional", flushes == 5 && worst == 0 );
+
+  reset();
+  stream( 1, 1000, 1, 0 );
+  check( "immediate", flushes == 1000 && worst == 0 );
+
+  for (period = 1; period < MAX; period += 3)
+  {
+    reset();
+    stream( period, 2000, 0, 0 );
+    check( "trickle", !pending && worst <= MAX && flushes > 1 );
+
+    reset();
+    stream( period, 2000, 1, 1 );
+    check( "trickle held by CR", !pending && worst <= MAX && flushes > 1 );
+  }
+
+  // Progress lines.
+  reset();
+  line = 1;
+  step_time[1] = now;
+  do_write( 0, 0 );
+  check( "progress after a pause", shown == 1 && worst == 0 );
+
+  reset();
+  line = 1;
+  step_time[1] = now;
+  do_write( 0, 1 );
+  for (period = 0; period < MIN; ++period)
+    tick();
+  check( "progress held by CR", shown == 1 && worst == MIN );
+
+  for (period = 1; period < MAX; period += 2)
+  {
+    reset();
+    progress( period, 0 );
+    check( "\\rprogress", shown == STEPS && worst <= MAX && flushes > 1 );
+
+    reset();
+    progress( period, 1 );
+    check( "progress\\r", shown == STEPS && worst <= MAX && flushes > 1 );
+  }
+
+  // The longest delay is only reached by doubling.
+  reset();
+  stream( 1, 200, 0, 0 );
+  check( "doubling", f.delay == MAX );
+
+  if (failures == 0)
+    printf( "All passed.\n" );
+  return (failures != 0);
+}
@@ -0,0 +1,330 @@
+/*
+  grid_test.c - Test the window copy used by ANSICON_GRID (grid.h).
+
+  Operations (as used by the erase, insert, delete and scroll sequences, plus
+  text) are done both through the grid and directly on a model of the console
+  buffer.  The grid's changes are written to a separate copy of the console
+  (and anything the grid can't do is done directly on it, after writing the
+  changes, as ANSI.c does), which must always end up the same as the model.
+
+  Build and run with "make" in this directory.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include "../grid.h"
+
+#define W     20		// buffer width
+#define H     30		// buffer height
+#define TOP   5 		// window top
+#define ROWS  12		// window height
+
+typedef GCELL BUF[H][W];
+
+BUF   model, con;
+GRID  grid;
+GCELL grid_mem[W * ROWS + ROWS];	// cells and changes (GRID_SIZE)
+int   active;			// the grid has the window
+int   failures;
+
+unsigned long seed = 1;
+int rnd( int n )
+{
+  seed = seed * 1103515245 + 12345;
+  return (int)((seed >> 16) % n);
+}
+
+
+// ========== Direct operations on a buffer.
+
+void buf_fill( BUF b, unsigned long len, int x, int y, const GCELL* fill )
+{
+  for (; len > 0 && y < H; --len)
+  {
+    b[y][x] = *fill;
+    if (++x == W)
+    {
+      x = 0;
+      ++y;
+    }
+  }
+}
+
+// ScrollConsoleScreenBuffer: copy the source (in the buffer), fill the source
+// (in the clip), then write the copy to the destination (in the clip).
+void buf_scroll( BUF b, const GRECT* rect, const GRECT* clip, int x, int y,
+		 const GCELL* fill )
+{
+  static BUF copy;
+  GRECT all = { 0, 0, W - 1, H - 1 };
+  GRECT s = *rect, c = *clip;
+  int	i, j, dx, dy;
+
+  dx = x - rect->left;
+  dy = y - rect->top;
+  if (!gr_clip( &s, &all ))
+    return;
+  gr_clip( &c, &all );
+  memcpy( copy, b, sizeof(copy) );
+  for (i = s.top; i <= s.bottom; ++i)
+    for (j = s.left; j <= s.right; ++j)
+      if (i >= c.top && i <= c.bottom && j >= c.left && j <= c.right)
+	b[i][j] = *fill;
+  for (i = s.top; i <= s.bottom; ++i)
+    for (j = s.left; j <= s.right; ++j)
+      if (i + dy >= c.top && i + dy <= c.bottom &&
+	  j + dx >= c.left && j + dx <= c.right)
+	b[i+dy][j+dx] = copy[i][j];
+}
+
+void buf_text( BUF b, int x, int y, const unsigned short* text, int len,
+	       unsigned short attr )
+{
+  for (; len > 0; --len, ++text)
+  {
+    if (*text == '\r')
+      x = 0;
+    else if (*text == '\b')
+    {
+      if (x > 0)
+	--x;
+    }
+    else if (x < W)
+    {
+      b[y][x].ch = *text;
+      b[y][x].attr = attr;
+      ++x;
+    }
+  }
+}
+
+
+// ========== The grid, as ANSI.c uses it.
+
+void grid_flush( void )
+{
+  GRECT r;
+  int	row = 0, i, j;
+
+  while (gr_next_rect( &grid, &row, &r ))
+    for (i = r.top; i <= r.bottom; ++i)
+      for (j = r.left; j <= r.right; ++j)
+	con[TOP+i][j] = grid.cell[i * W + j];
+}
+
+void grid_sync( void )
+{
+  if (active)
+  {
+    grid_flush();
+    active = 0;
+  }
+}
+
+void grid_ready( void )
+{
+  if (!active)
+  {
+    gr_init( &grid, grid_mem, TOP, W, ROWS );
+    memcpy( grid.cell, con[TOP], sizeof(GCELL) * W * ROWS );
+    active = 1;
+  }
+}
+
+void check( const char* what, int n )
+{
+  grid_flush();
+  if (memcmp( con, model, sizeof(model) ) != 0)
+  {
+    printf( "FAIL: %s (operation %d)\n", what, n );
+    ++failures;
+    memcpy( con, model, sizeof(model) );
+    active = 0;
+  }
+}
+
+
+// ========== Operations, through the grid and the model.
+
+void op_fill( unsigned long len, int x, int y, const GCELL* fill )
+{
+  grid_ready();
+  if (!gr_fill( &grid, len, x, y, fill ))
+  {
+    grid_sync();
+    buf_fill( con, len, x, y, fill );
+  }
+  buf_fill( model, len, x, y, fill );
+}
+
+void op_scroll( int l, int t, int r, int b, int cl, int ct, int cr, int cb,
+		int x, int y, const GCELL* fill )
+{
+  GRECT rect, clip;
+
+  rect.left = l; rect.top = t; rect.right = r; rect.bottom = b;
+  clip.left = cl; clip.top = ct; clip.right = cr; clip.bottom = cb;
+  grid_ready();
+  if (!gr_scroll( &grid, &rect, &clip, x, y, fill ))
+  {
+    grid_sync();
+    buf_scroll( con, &rect, &clip, x, y, fill );
+  }
+  buf_scroll( model, &rect, &clip, x, y, fill );
+}
+
+// Returns the new column.
+int op_text( int x, int y, const char* s, unsigned short attr )
+{
+  unsigned short text[64];
+  int len, nx;
+
+  for (len = 0; s[len] != '\0'; ++len)
+    text[len] = (unsigned char)s[len];
+  grid_ready();
+  nx = gr_text( &grid, x, y, text, len, 1, attr );
+  if (nx < 0)
+  {
+    // The console would wrap; just keep to the line for the test.
+    grid_sync();
+    buf_text( con, x, y, text, len, attr );
+  }
+  buf_text( model, x, y, text, len, attr );
+  return nx;
+}
+
+
+// ========== The sequences, in terms of the operations.
+
+GCELL blank = { ' ', 7 };
+int   top_margin = TOP + 2, bot_margin = TOP + 9;	// DECSTBM
+
+void seq_ed( int x, int y )		// ED 0 (just the line below the window)
+{
+  int rows = (y < TOP + ROWS) ? TOP + ROWS - y : 1;
+
+  op_fill( (unsigned long)(rows * W - x), x, y, &blank );
+}
+
+void seq_el( int x, int y )		// EL 0
+{
+  op_fill( W - x, x, y, &blank );
+}
+
+void seq_ich( int x, int y, int n )	// ICH
+{
+  op_scroll( x, y, W - 1, y, x, y, W - 1, y, x + n, y, &blank );
+}
+
+void seq_dch( int x, int y, int n )	// DCH
+{
+  op_scroll( x + n, y, W - 1, y, x, y, W - 1, y, x, y, &blank );
+}
+
+void seq_il( int y, int n )		// IL within the margins
+{
+  op_scroll( 0, y, W - 1, bot_margin, 0, top_margin, W - 1, bot_margin,
+	     0, y + n, &blank );
+}
+
+void seq_dl( int y, int n )		// DL within the margins
+{
+  op_scroll( 0, y + n, W - 1, bot_margin, 0, top_margin, W - 1, bot_margin,
+	     0, y, &blank );
+}
+
+void seq_su( int n )			// SU within the margins
+{
+  op_scroll( 0, top_margin + n, W - 1, bot_margin,
+	     0, top_margin, W - 1, bot_margin, 0, top_margin, &blank );
+}
+
+void seq_sd( int n )			// SD within the margins
+{
+  op_scroll( 0, top_margin, W - 1, bot_margin - n,
+	     0, top_margin, W - 1, bot_margin, 0, top_margin + n, &blank );
+}
+
+void seq_scroll_buffer( int n ) 	// newline at the bottom of the buffer
+{
+  op_scroll( 0, n, W - 1, H - 1, 0, 0, W - 1, H - 1, 0, 0, &blank );
+}
+
+
+int main( void )
+{
+  static const char* words[] = { "hello", "ab\rc", "xy\bz", "0123456789",
+				 "a", "\r", "wrap me around the end" };
+  int i, j, x, y, n;
+
+  for (i = 0; i < H; ++i)
+    for (j = 0; j < W; ++j)
+    {
+      model[i][j].ch = 'A' + (i + j) % 26;
+      model[i][j].attr = (unsigned short)(i % 16);
+    }
+  memcpy( con, model, sizeof(model) );
+
+  // Each sequence on its own.
+  seq_ed( 3, TOP + 4 );         check( "ED", 0 );
+  seq_el( 7, TOP + 1 );         check( "EL", 0 );
+  seq_el( 0, TOP + ROWS - 1 );  check( "EL last line", 0 );
+  seq_ich( 4, TOP + 3, 5 );     check( "ICH", 0 );
+  seq_ich( 4, TOP + 3, W );     check( "ICH past the end", 0 );
+  seq_dch( 2, TOP + 6, 3 );     check( "DCH", 0 );
+  seq_dch( 2, TOP + 6, W );     check( "DCH past the end", 0 );
+  seq_il( top_margin + 1, 2 );  check( "IL", 0 );
+  seq_il( top_margin, 20 );     check( "IL past the margin", 0 );
+  seq_dl( top_margin + 3, 1 );  check( "DL", 0 );
+  seq_dl( top_margin, 20 );     check( "DL past the margin", 0 );
+  seq_su( 3 );			check( "SU", 0 );
+  seq_sd( 4 );			check( "SD", 0 );
+  op_text( 3, TOP + 2, "text", 0x1F ); check( "text", 0 );
+  op_text( 15, TOP + 2, "too long", 0x1F ); check( "text (wrap)", 0 );
+  seq_ed( 0, TOP - 1 );         check( "ED above the window", 0 );
+  seq_scroll_buffer( 1 );	check( "buffer scroll", 0 );
+
+  // And at random.
+  for (n = 1; n <= 100000; ++n)
+  {
+    x = rnd( W );
+    y = TOP - 1 + rnd( ROWS + 2 );	// sometimes outside the window
+    if (y >= H) y = H - 1;
+    switch (rnd( 11 ))
+    {
+      case 0: seq_ed( x, y ); break;
+      case 1: seq_el( x, y ); break;
+      case 2: seq_ich( x, y, 1 + rnd( W ) ); break;
+      case 3: seq_dch( x, y, 1 + rnd( W ) ); break;
+      case 4: if (y >= top_margin && y <= bot_margin)
+		seq_il( y, 1 + rnd( 12 ) );
+	      break;
+      case 5: if (y >= top_margin && y <= bot_margin)
+		seq_dl( y, 1 + rnd( 12 ) );
+	      break;
+      case 6: seq_su( 1 + rnd( 12 ) ); break;
+      case 7: seq_sd( 1 + rnd( 12 ) ); break;
+      case 8: seq_scroll_buffer( 1 + rnd( 3 ) ); break;
+      case 9:
+	top_margin = TOP + rnd( ROWS / 2 );
+	bot_margin = top_margin + 1 + rnd( ROWS / 2 - 1 );
+	break;
+      default:
+	blank.attr = (unsigned short)rnd( 256 );
+	op_text( x, y, words[rnd( 7 )], (unsigned short)rnd( 256 ) );
+	break;
+    }
+    // Check after a few operations, as ANSI.c flushes.
+    if (rnd( 4 ) == 0)
+      check( "random", n );
+  }
+  check( "random", n );
+
+  if (failures)
+  {
+    printf( "%d failures\n", failures );
+    return 1;
+  }
+  printf( "All passed.\n" );
+  return 0;
+}
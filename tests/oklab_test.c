@@ -0,0 +1,175 @@
+/*
+  oklab_test.c - Test the fixed-point Oklab of ANSICON_NEAREST (oklab.h)
+		 against floating point.
+
+  The conversion is checked for all 256 levels of red, green, blue and gray:
+  each component may be off by at most 0.004 (L being 0-1; a difference of
+  about 0.02 can just be seen).  The nearest color is checked for every color
+  (using the default Windows 10 palette and the legacy one): using the middle
+  of its 8x8x8 block, the color chosen may be further than the nearest by at
+  most 0.03 (the colors of the palettes being 0.1 or more apart).  At the time
+  of writing, the worst was 0.0036 for the conversion (a and b of the darkest
+  colors, where the 16-bit linear light is coarse) and 0.029 for the nearest
+  color, with about 4% of colors choosing another (about as near) color.
+
+  Build and run with "make" in this directory.
+*/
+
+#include <stdio.h>
+#include <math.h>
+#include "../oklab.h"
+
+#define MAX_LAB     0.004 	// largest error of a component
+#define MAX_EXTRA   0.03	// largest extra distance of the nearest color
+
+int failures;
+
+static const unsigned long palettes[2][16] =
+{
+  // Windows 10 (Campbell), as RGB.
+  { 0x0C0C0C, 0x0037DA, 0x13A10E, 0x3A96DD, 0xC50F1F, 0x881798, 0xC19C00,
+    0xCCCCCC, 0x767676, 0x3B78FF, 0x16C60C, 0x61D6D6, 0xE74856, 0xB4009E,
+    0xF9F1A5, 0xF2F2F2 },
+  // Legacy.
+  { 0x000000, 0x000080, 0x008000, 0x008080, 0x800000, 0x800080, 0x808000,
+    0xC0C0C0, 0x808080, 0x0000FF, 0x00FF00, 0x00FFFF, 0xFF0000, 0xFF00FF,
+    0xFFFF00, 0xFFFFFF },
+};
+
+
+double linear[256];
+
+void init_linear( void )
+{
+  double v;
+  int	 c;
+
+  for (c = 0; c < 256; ++c)
+  {
+    v = c / 255.0;
+    linear[c] = (v <= 0.04045) ? v / 12.92 : pow( (v + 0.055) / 1.055, 2.4 );
+  }
+}
+
+void ref_lab( int red, int green, int blue, double* lab )
+{
+  double r = linear[red], g = linear[green], b = linear[blue];
+  double l = cbrt( 0.4122214708 * r + 0.5363325363 * g + 0.0514459929 * b );
+  double m = cbrt( 0.2119034982 * r + 0.6806995451 * g + 0.1073969566 * b );
+  double s = cbrt( 0.0883024619 * r + 0.2817188376 * g + 0.6299787005 * b );
+
+  lab[0] = 0.2104542553 * l + 0.7936177850 * m - 0.0040720468 * s;
+  lab[1] = 1.9779984951 * l - 2.4285922050 * m + 0.4505937099 * s;
+  lab[2] = 0.0259040371 * l + 0.7827717662 * m - 0.8086757660 * s;
+}
+
+double distance2( const double* a, const double* b )
+{
+  return (a[0] - b[0]) * (a[0] - b[0]) +
+	 (a[1] - b[1]) * (a[1] - b[1]) +
+	 (a[2] - b[2]) * (a[2] - b[2]);
+}
+
+
+// Compare the conversion of one color, returning the largest error.
+double convert( int r, int g, int b )
+{
+  int	 lab[3], i;
+  double ref[3], err, worst = 0;
+
+  ok_lab( r, g, b, lab );
+  ref_lab( r, g, b, ref );
+  for (i = 0; i < 3; ++i)
+  {
+    err = fabs( lab[i] / 16384.0 - ref[i] );
+    if (err > worst)
+      worst = err;
+  }
+  return worst;
+}
+
+
+int main( void )
+{
+  static unsigned char cube[2][32*32*32];
+  int	 pal[2][16][3];
+  double pal_ref[2][16][3], lab[3], d, d_min, extra;
+  double worst, worst_extra[2];
+  long	 differ[2];
+  int	 p, i, c, r, g, b, near, exact;
+
+  init_linear();
+
+  // The conversion.
+  worst = 0;
+  for (c = 0; c < 256; ++c)
+  {
+    if ((d = convert( c, 0, 0 )) > worst) worst = d;
+    if ((d = convert( 0, c, 0 )) > worst) worst = d;
+    if ((d = convert( 0, 0, c )) > worst) worst = d;
+    if ((d = convert( c, c, c )) > worst) worst = d;
+  }
+  printf( "largest error converting: %.4f\n", worst );
+  if (worst > MAX_LAB)
+  {
+    printf( "FAIL: conversion (more than %.4f)\n", MAX_LAB );
+    ++failures;
+  }
+
+  // The nearest color.
+  for (p = 0; p < 2; ++p)
+  {
+    for (i = 0; i < 16; ++i)
+    {
+      r = (int)(palettes[p][i] >> 16);
+      g = (int)(palettes[p][i] >> 8) & 0xFF;
+      b = (int)palettes[p][i] & 0xFF;
+      ok_lab( r, g, b, pal[p][i] );
+      ref_lab( r, g, b, pal_ref[p][i] );
+    }
+    worst_extra[p] = 0;
+    differ[p] = 0;
+  }
+  for (r = 0; r < 256; ++r)
+    for (g = 0; g < 256; ++g)
+      for (b = 0; b < 256; ++b)
+      {
+	ref_lab( r, g, b, lab );
+	for (p = 0; p < 2; ++p)
+	{
+	  near = ok_nearest( cube[p], (const int (*)[3])pal[p], r, g, b );
+	  d_min = 1e9;
+	  exact = 0;
+	  for (i = 0; i < 16; ++i)
+	  {
+	    d = distance2( lab, pal_ref[p][i] );
+	    if (d < d_min)
+	    {
+	      d_min = d;
+	      exact = i;
+	    }
+	  }
+	  if (near != exact)
+	  {
+	    ++differ[p];
+	    extra = sqrt( distance2( lab, pal_ref[p][near] ) ) - sqrt( d_min );
+	    if (extra > worst_extra[p])
+	      worst_extra[p] = extra;
+	  }
+	}
+      }
+  for (p = 0; p < 2; ++p)
+  {
+    printf( "palette %d: largest extra distance %.4f, %.1f%% differ\n",
+	    p, worst_extra[p], differ[p] * 100.0 / (256 * 256 * 256) );
+    if (worst_extra[p] > MAX_EXTRA)
+    {
+      printf( "FAIL: nearest color (more than %.4f)\n", MAX_EXTRA );
+      ++failures;
+    }
+  }
+
+  if (failures == 0)
+    printf( "All passed.\n" );
+  return (failures != 0);
+}
@@ -0,0 +1,715 @@
+/*
+  parse_test.c - Test the parser's tables (parse.h) against the parser they
+		 replaced.
+
+  The old parser (a chain of ifs for each state) is modelled as it was, and
+  so are the actions of ParseString (without its runs, which do the same
+  thing several characters at once).  Both record what they do; every state
+  is tried with every ASCII character (and some above), followed by random
+  text.  The one intended difference is RIS, which now returns to normal text
+  (the old parser stayed in the escape state).
+
+  Build and run with "make" in this directory.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../parse.h"
+
+#define ESC	'\x1B'
+#define BEL	'\x07'
+#define SO	'\x0E'
+#define SI	'\x0F'
+#define HT	'\t'
+
+#define MAX_ARG 16
+#define PT_LEN	32
+
+int failures;
+
+typedef struct
+{
+  int  state, crm, tabs, im, shifted, G0_special;
+  int  prefix, prefix2, suffix, suffix2, ibytes;
+  int  es_argc, es_argv[MAX_ARG];
+  int  Pt_len;
+  int  Pt_arg[PT_LEN];
+  char trace[8192];
+  int  len;
+} PARSER;
+
+
+// Record what's done.
+void emit( PARSER* p, const char* fmt, int c )
+{
+  if (p->len < (int)sizeof(p->trace) - 32)
+    p->len += sprintf( p->trace + p->len, fmt, c );
+}
+
+void note( PARSER* p, const char* s )
+{
+  if (p->len < (int)sizeof(p->trace) - 32)
+    p->len += sprintf( p->trace + p->len, "%s", s );
+}
+
+void push( PARSER* p, int c )
+{
+  emit( p, "%x ", c );
+}
+
+// What InterpretEscSeq does, as far as the parser is concerned.
+void interpret( PARSER* p )
+{
+  int i;
+
+  emit( p, "[%c", p->prefix );
+  emit( p, "%c", p->prefix2 ? p->prefix2 : '_' );
+  for (i = 0; i < p->es_argc; ++i)
+    emit( p, "%d;", p->es_argv[i] );
+  if (p->prefix == ']')
+  {
+    for (i = 0; i < p->Pt_len; ++i)
+      emit( p, "%x,", p->Pt_arg[i] );
+  }
+  else
+  {
+    emit( p, "%c", p->suffix );
+    if (p->prefix2 == 0 && (p->suffix == 'h' || p->suffix == 'l'))
+    {
+      for (i = 0; i < p->es_argc; ++i)
+      {
+	if (p->es_argv[i] == 3 && p->suffix == 'h')
+	  p->crm = 1;
+	else if (p->es_argv[i] == 4)
+	  p->im = (p->suffix == 'h');
+      }
+    }
+  }
+  note( p, "] " );
+}
+
+void reset( PARSER* p )
+{
+  note( p, "ris " );
+  p->tabs = p->im = p->shifted = p->G0_special = 0;
+}
+
+
+// The old parser, states 1 to 9.
+void old_parse( PARSER* p, int c )
+{
+  if (p->state == 1)
+  {
+    if (c == ESC)
+    {
+      p->suffix2 = 0;
+      p->ibytes = 0;
+      p->state = (p->crm) ? 7 : 2;
+    }
+    else if (p->crm) push( p, c );
+    else if (c == BEL) note( p, "bel " );
+    else if (c == SO) p->shifted = 1;
+    else if (c == SI) p->shifted = p->G0_special;
+    else if (c == HT && p->tabs) note( p, "tab " );
+    else if (p->im && (c == HT || c == '\r' || c == '\b' || c == '\n'))
+      emit( p, "im%x ", c );
+    else push( p, c );
+  }
+  else if (p->state == 2)
+  {
+    if (c < 0x20)
+    {
+      emit( p, "ctl%x ", c );
+      p->state = 1;
+    }
+    else if (c >= 0x20 && c <= 0x2f)
+    {
+      p->suffix2 = c;
+      ++p->ibytes;
+    }
+    else if (p->ibytes != 0)
+    {
+      if (p->ibytes == 1 && p->suffix2 == '(')
+      {
+	if (c == '0')
+	  p->shifted = p->G0_special = 1;
+	else if (c == 'B')
+	  p->shifted = p->G0_special = 0;
+      }
+      p->state = 1;
+    }
+    else if (c == 'E') { push( p, '\n' ); p->state = 1; }
+    else if (c == 'D') { note( p, "ind " ); p->state = 1; }
+    else if (c == 'M') { note( p, "ri " ); p->state = 1; }
+    else if (c == 'H') { p->tabs = 1; note( p, "hts " ); p->state = 1; }
+    else if (c == '7') { note( p, "sc " ); p->state = 1; }
+    else if (c == '8') { note( p, "rc " ); p->state = 1; }
+    else if (c == 'c') { reset( p ); p->state = 1; }  // (it stayed in 2)
+    else if (c == '[' || c == ']')
+    {
+      p->prefix = c;
+      p->prefix2 = 0;
+      p->es_argc = 0;
+      p->es_argv[0] = p->es_argv[1] = 0;
+      p->Pt_len = 0;
+      p->Pt_arg[0] = 0;
+      p->state = 3;
+    }
+    else if (c == 'P' || c == 'X' || c == '^' || c == '_')
+    {
+      p->Pt_arg[0] = 0;
+      p->state = 6;
+    }
+    else
+    {
+      push( p, ESC );
+      push( p, c );
+      p->state = 1;
+    }
+  }
+  else if (p->state == 3)
+  {
+    if (c >= '0' && c <= '9')
+    {
+      p->es_argv[0] = c - '0';
+      p->state = 4;
+    }
+    else if (c == ';')
+    {
+      p->es_argc = 1;
+      p->state = 4;
+    }
+    else if (c == ':') ;
+    else if (c >= 0x3c && c <= 0x3f) p->prefix2 = c;
+    else if (c >= 0x20 && c <= 0x2f)
+    {
+      p->suffix2 = c;
+      ++p->ibytes;
+    }
+    else if (p->ibytes > 1) p->state = 1;
+    else
+    {
+      p->es_argc = 0;
+      p->suffix = c;
+      interpret( p );
+      p->state = 1;
+    }
+  }
+  else if (p->state == 4)
+  {
+    if (c >= '0' && c <= '9')
+    {
+      p->es_argv[p->es_argc] = 10 * p->es_argv[p->es_argc] + (c - '0');
+      if (p->es_argv[p->es_argc] > 32767) p->es_argv[p->es_argc] = 32767;
+    }
+    else if (c == ';')
+    {
+      if (p->es_argc < MAX_ARG-1) p->es_argc++;
+      p->es_argv[p->es_argc] = 0;
+      if (p->prefix == ']')
+	p->state = 5;
+    }
+    else if (c >= 0x3a && c <= 0x3f) ;
+    else if (c >= 0x20 && c <= 0x2f)
+    {
+      p->suffix2 = c;
+      ++p->ibytes;
+    }
+    else if (p->ibytes > 1) p->state = 1;
+    else if (p->prefix == ']')
+    {
+      p->es_argc++;
+      p->state = 5;
+      old_parse( p, c );	// goto state5
+    }
+    else
+    {
+      p->es_argc++;
+      p->suffix = c;
+      interpret( p );
+      p->state = 1;
+    }
+  }
+  else if (p->state == 5)
+  {
+    if (c == BEL)
+    {
+      interpret( p );
+      p->state = 1;
+    }
+    else if (c == '\\' && p->Pt_len > 0 && p->Pt_arg[p->Pt_len-1] == ESC)
+    {
+      --p->Pt_len;
+      interpret( p );
+      p->state = 1;
+    }
+    else if (p->Pt_len < PT_LEN-1)
+      p->Pt_arg[p->Pt_len++] = c;
+  }
+  else if (p->state == 6)
+  {
+    if (c == BEL || (c == '\\' && p->Pt_arg[0] == ESC))
+      p->state = 1;
+    else
+      p->Pt_arg[0] = c;
+  }
+  else if (p->state == 7)
+  {
+    if (c == '[') p->state = 8;
+    else
+    {
+      push( p, ESC );
+      if (c != ESC)
+      {
+	push( p, c );
+	p->state = 1;
+      }
+    }
+  }
+  else if (p->state == 8)
+  {
+    if (c == '3') p->state = 9;
+    else
+    {
+      push( p, ESC );
+      push( p, '[' );
+      if (c == ESC) p->state = 7;
+      else
+      {
+	push( p, c );
+	p->state = 1;
+      }
+    }
+  }
+  else // (p->state == 9)
+  {
+    if (c == 'l')
+    {
+      p->crm = 0;
+      p->state = 1;
+    }
+    else
+    {
+      push( p, ESC );
+      push( p, '[' );
+      push( p, '3' );
+      if (c == ESC) p->state = 7;
+      else
+      {
+	push( p, c );
+	p->state = 1;
+      }
+    }
+  }
+}
+
+
+// The actions of ParseString.
+void new_parse( PARSER* p, int c )
+{
+  int cls = (c < 128) ? char_class[c] : CL_PRINT;
+
+again:
+  switch (parse_table[p->state][cls])
+  {
+    case A_NONE:
+    break;
+
+    case A_PRINT:
+      push( p, c );
+    break;
+
+    case A_BEL:
+      if (p->crm) push( p, c );
+      else note( p, "bel " );
+    break;
+
+    case A_ESC:
+      p->suffix2 = 0;
+      p->ibytes = 0;
+      p->state = (p->crm) ? S_CRM_ESC : S_ESC;
+    break;
+
+    case A_SO:
+      if (p->crm) push( p, c );
+      else p->shifted = 1;
+    break;
+
+    case A_SI:
+      if (p->crm) push( p, c );
+      else p->shifted = p->G0_special;
+    break;
+
+    case A_HT:
+      if (p->tabs && !p->crm)
+      {
+	note( p, "tab " );
+	break;
+      }
+      // fall through
+
+    case A_FMT:
+      if (p->im && !p->crm)
+	emit( p, "im%x ", c );
+      else
+	push( p, c );
+    break;
+
+    case A_CONTROL:
+      emit( p, "ctl%x ", c );
+      p->state = S_GROUND;
+    break;
+
+    case A_INTER:
+      p->suffix2 = c;
+      ++p->ibytes;
+      if (p->state == S_ESC)
+	p->state = S_ESC_INT;
+    break;
+
+    case A_SCS:
+      if (p->ibytes == 1 && p->suffix2 == '(')
+      {
+	if (c == '0')
+	  p->shifted = p->G0_special = 1;
+	else if (c == 'B')
+	  p->shifted = p->G0_special = 0;
+      }
+      p->state = S_GROUND;
+    break;
+
+    case A_ESC_FINAL:
+      p->state = S_GROUND;
+      switch (c)
+      {
+	case 'E': push( p, '\n' ); break;
+	case 'D': note( p, "ind " ); break;
+	case 'M': note( p, "ri " ); break;
+	case 'H': p->tabs = 1; note( p, "hts " ); break;
+	case '7': note( p, "sc " ); break;
+	case '8': note( p, "rc " ); break;
+	case 'c': reset( p ); break;
+	default:
+	  push( p, ESC );
+	  push( p, c );
+	break;
+      }
+    break;
+
+    case A_CSI:
+      p->prefix = c;
+      p->prefix2 = 0;
+      p->es_argc = 0;
+      p->es_argv[0] = p->es_argv[1] = 0;
+      p->Pt_len = 0;
+      p->Pt_arg[0] = 0;
+      p->state = S_CSI;
+    break;
+
+    case A_STRING:
+      p->Pt_arg[0] = 0;
+      p->state = S_STR;
+    break;
+
+    case A_FIRST_ARG:
+      p->es_argv[0] = c - '0';
+      p->state = S_PARAM;
+    break;
+
+    case A_FIRST_SEP:
+      p->es_argc = 1;
+      p->state = S_PARAM;
+    break;
+
+    case A_PRIVATE:
+      p->prefix2 = c;
+    break;
+
+    case A_CSI_FINAL:
+      if (p->ibytes <= 1)
+      {
+	p->es_argc = 0;
+	p->suffix = c;
+	interpret( p );
+      }
+      p->state = S_GROUND;
+    break;
+
+    case A_ARG:
+      p->es_argv[p->es_argc] = 10 * p->es_argv[p->es_argc] + (c - '0');
+      if (p->es_argv[p->es_argc] > 32767) p->es_argv[p->es_argc] = 32767;
+    break;
+
+    case A_SEP:
+      if (p->es_argc < MAX_ARG-1) p->es_argc++;
+      p->es_argv[p->es_argc] = 0;
+      if (p->prefix == ']')
+	p->state = S_OSC_STR;
+    break;
+
+    case A_FINAL:
+      if (p->ibytes > 1)
+	p->state = S_GROUND;
+      else if (p->prefix == ']')
+      {
+	p->es_argc++;
+	p->state = S_OSC_STR;
+	goto again;
+      }
+      else
+      {
+	p->es_argc++;
+	p->suffix = c;
+	interpret( p );
+	p->state = S_GROUND;
+      }
+    break;
+
+    case A_OSC_ST:
+      if (p->Pt_len > 0 && p->Pt_arg[p->Pt_len-1] == ESC)
+      {
+	--p->Pt_len;
+	interpret( p );
+	p->state = S_GROUND;
+	break;
+      }
+      // fall through
+
+    case A_OSC_PUT:
+      if (p->Pt_len < PT_LEN-1)
+	p->Pt_arg[p->Pt_len++] = c;
+    break;
+
+    case A_OSC_END:
+      interpret( p );
+      p->state = S_GROUND;
+    break;
+
+    case A_STR_ST:
+      if (p->Pt_arg[0] == ESC)
+      {
+	p->state = S_GROUND;
+	break;
+      }
+      // fall through
+
+    case A_STR_PUT:
+      p->Pt_arg[0] = c;
+    break;
+
+    case A_STR_END:
+      p->state = S_GROUND;
+    break;
+
+    case A_CRM:
+      if (p->state == S_CRM_ESC)
+      {
+	if (c == '[') p->state = S_CRM_CSI;
+	else
+	{
+	  push( p, ESC );
+	  if (c != ESC)
+	  {
+	    push( p, c );
+	    p->state = S_GROUND;
+	  }
+	}
+      }
+      else if (p->state == S_CRM_CSI)
+      {
+	if (c == '3') p->state = S_CRM_3;
+	else
+	{
+	  push( p, ESC );
+	  push( p, '[' );
+	  if (c == ESC) p->state = S_CRM_ESC;
+	  else
+	  {
+	    push( p, c );
+	    p->state = S_GROUND;
+	  }
+	}
+      }
+      else
+      {
+	if (c == 'l')
+	{
+	  p->crm = 0;
+	  p->state = S_GROUND;
+	}
+	else
+	{
+	  push( p, ESC );
+	  push( p, '[' );
+	  push( p, '3' );
+	  if (c == ESC) p->state = S_CRM_ESC;
+	  else
+	  {
+	    push( p, c );
+	    p->state = S_GROUND;
+	  }
+	}
+      }
+    break;
+  }
+}
+
+
+// The new state corresponding to an old one.
+int new_state( const PARSER* p )
+{
+  if (p->state == 1)
+    return S_GROUND;
+  if (p->state == 2)
+    return (p->ibytes != 0) ? S_ESC_INT : S_ESC;
+  return p->state;		// the others are the same
+}
+
+
+PARSER old_p, new_p;
+
+void start( void )
+{
+  memset( &old_p, 0, sizeof(old_p) );
+  memset( &new_p, 0, sizeof(new_p) );
+  old_p.state = 1;
+  new_p.state = S_GROUND;
+}
+
+// Parse the text with both, returning 1 if they did the same.
+int same( const int* text, int len )
+{
+  int i;
+
+  for (i = 0; i < len; ++i)
+  {
+    old_parse( &old_p, text[i] );
+    new_parse( &new_p, text[i] );
+    if (new_state( &old_p ) != new_p.state)
+      return 0;
+  }
+  return (old_p.len == new_p.len &&
+	  memcmp( old_p.trace, new_p.trace, old_p.len ) == 0);
+}
+
+
+void show( const int* text, int len )
+{
+  int i;
+
+  printf( "  text:" );
+  for (i = 0; i < len; ++i)
+    printf( " %x", text[i] );
+  printf( "\n  old (state %d): %.*s\n  new (state %d): %.*s\n",
+	  old_p.state, old_p.len, old_p.trace,
+	  new_p.state, new_p.len, new_p.trace );
+}
+
+
+// Sequences to reach each state (and mode).
+static const char* const prefixes[] =
+{
+  "",                           // normal text
+  "\x1B[4h",                    // insert mode
+  "\x1BH",                      // tabs
+  "\x1B[4h\x1BH",               // both
+  "\x1B",                       // ESC
+  "\x1B(",                      // ESC with intermediate
+  "\x1B !",                     // ESC with two intermediates
+  "\x1B[",                      // CSI
+  "\x1B[?",                     // CSI private
+  "\x1B[ ",                     // CSI intermediate
+  "\x1B[ !",                    // CSI two intermediates
+  "\x1B[1",                     // parameter
+  "\x1B[1;",                    // next parameter
+  "\x1B[;",                     // empty first parameter
+  "\x1B[1 !",                   // parameter two intermediates
+  "\x1B]",                      // OSC
+  "\x1B]0",                     // OSC parameter
+  "\x1B]0;",                    // OSC text
+  "\x1B]0;a\x1B",               // OSC text with ESC
+  "\x1BP",                      // DCS
+  "\x1BPa\x1B",                 // DCS with ESC
+  "\x1B[3h",                    // CRM
+  "\x1B[3h\x1B",                // CRM ESC
+  "\x1B[3h\x1B[",               // CRM CSI
+  "\x1B[3h\x1B[3",              // CRM CSI 3
+};
+
+// Characters above ASCII.
+static const int high[] = { 0x80, 0x9B, 0x9C, 0xA0, 0xE9, 0x4E00, 0xFFFF };
+
+// Characters to make up random text (weighted to escape sequences).
+static const char alphabet[] =
+  "\x1B\x1B\x1B\x1B[[[]]];;;;0123456789:?< !(\a\t\b\n\r\x0E\x0F\x01"
+  "\\\\PX^_cEDMH78mhlJKABabcx";
+
+
+int main( void )
+{
+  int text[64], len, n, i, c, p, ok, fails;
+
+  // Every state with every character.
+  fails = 0;
+  for (p = 0; p < (int)(sizeof(prefixes) / sizeof(*prefixes)); ++p)
+  {
+    for (c = 0; c < 128 + (int)(sizeof(high) / sizeof(*high)); ++c)
+    {
+      for (len = 0; prefixes[p][len] != '\0'; ++len)
+	text[len] = (unsigned char)prefixes[p][len];
+      text[len++] = (c < 128) ? c : high[c - 128];
+      // Finish whatever was started.
+      text[len++] = 'x';
+      text[len++] = BEL;
+      text[len++] = ESC;
+      text[len++] = '\\';
+      text[len++] = 'y';
+      start();
+      if (!same( text, len ))
+      {
+	if (fails++ < 5)
+	{
+	  printf( "FAIL: state %d, character %x\n", p, text[len-6] );
+	  show( text, len );
+	}
+      }
+    }
+  }
+  if (fails)
+  {
+    printf( "FAIL: %d states & characters\n", fails );
+    ++failures;
+  }
+
+  // Random text.
+  srand( 1 );
+  fails = 0;
+  for (n = 0; n < 200000; ++n)
+  {
+    len = 1 + rand() % 64;
+    for (i = 0; i < len; ++i)
+    {
+      if (rand() % 16 == 0)
+	text[i] = (rand() % 2) ? rand() % 128 : high[rand() % 7];
+      else
+	text[i] = (unsigned char)alphabet[rand() % (sizeof(alphabet) - 1)];
+    }
+    start();
+    ok = same( text, len );
+    if (!ok && fails++ < 5)
+    {
+      printf( "FAIL: random text\n" );
+      show( text, len );
+    }
+  }
+  if (fails)
+  {
+    printf( "FAIL: %d random texts\n", fails );
+    ++failures;
+  }
+
+  if (failures == 0)
+    printf( "All passed.\n" );
+  return (failures != 0);
+}
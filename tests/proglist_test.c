@@ -0,0 +1,239 @@
+/*
+  proglist_test.c - Test finding names in the program lists (proglist.h).
+
+  Build and run with "make" in this directory.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include "../proglist.h"
+
+int failures;
+
+int compares;			// calls to the comparison
+
+unsigned short fold( unsigned short c )
+{
+  return (c >= 'A' && c <= 'Z') ? c + 'a' - 'A' : c;
+}
+
+// As lstrcmpi usually does for these names.
+int cmp_ascii( const unsigned short* a, const unsigned short* b )
+{
+  ++compares;
+  while (*a != '\0' && fold( *a ) == fold( *b ))
+    ++a, ++b;
+  return fold( *a ) - fold( *b );
+}
+
+// As lstrcmpi does in Turkish: I pairs with dotless i, and dotted I with i.
+unsigned short fold_tr( unsigned short c )
+{
+  return (c == 'I')    ? 0x0131 :
+	 (c == 0x0130) ? 'i'    : fold( c );
+}
+
+int cmp_turkish( const unsigned short* a, const unsigned short* b )
+{
+  ++compares;
+  while (*a != '\0' && fold_tr( *a ) == fold_tr( *b ))
+    ++a, ++b;
+  return fold_tr( *a ) - fold_tr( *b );
+}
+
+// Equating the Kelvin sign with k, which folding ASCII doesn't.
+unsigned short fold_k( unsigned short c )
+{
+  return (c == 0x212A) ? 'k' : fold( c );
+}
+
+int cmp_kelvin( const unsigned short* a, const unsigned short* b )
+{
+  ++compares;
+  while (*a != '\0' && fold_k( *a ) == fold_k( *b ))
+    ++a, ++b;
+  return fold_k( *a ) - fold_k( *b );
+}
+
+
+// Widen a string (non-ASCII is written as "\x01" and four hex digits).
+const unsigned short* u( const char* s )
+{
+  static unsigned short buf[4][4096];
+  static int which;
+  unsigned short* w = buf[which = (which + 1) & 3];
+  unsigned short* p = w;
+  unsigned int c;
+
+  while (*s != '\0')
+  {
+    if (*s == '\x01')
+    {
+      sscanf( s + 1, "%4x", &c );
+      *p++ = (unsigned short)c;
+      s += 5;
+    }
+    else
+      *p++ = *s++;
+  }
+  *p = '\0';
+  return w;
+}
+
+
+PLIST		list;
+unsigned short	value[4096];
+unsigned short* slot[1024];
+
+// Split a list and hash it (unless NOHASH).
+void make( const char* names, int nohash )
+{
+  const unsigned short* w;
+  unsigned long size;
+  int i;
+
+  w = u( names );
+  for (i = 0; (value[i] = w[i]) != '\0'; ++i) ;
+  size = pl_split( &list, value, 1 );
+  if (size != 0 && !nohash)
+    pl_hash( &list, slot, size );
+}
+
+
+void check( const char* name, int ok )
+{
+  if (!ok)
+  {
+    printf( "FAIL: %s\n", name );
+    ++failures;
+  }
+}
+
+#define FIND( val )	    pl_find( &list, u( val ), cmp_ascii )
+#define FIND_CMP( val, c )  pl_find( &list, u( val ), c )
+
+
+// Model search_env: the variable is read again when its generation changes.
+unsigned short env[64];
+long	       env_gen = 1;
+
+int search_env( const char* val )
+{
+  unsigned long size;
+
+  if (list.gen != env_gen)
+  {
+    memcpy( value, env, sizeof(env) );
+    size = pl_split( &list, (*value) ? value : NULL, env_gen );
+    if (size != 0)
+      pl_hash( &list, slot, size );
+  }
+  return FIND( val );
+}
+
+void set_env( const char* names )
+{
+  const unsigned short* w = u( names );
+  int i;
+
+  for (i = 0; (env[i] = w[i]) != '\0'; ++i) ;
+}
+
+
+int main( void )
+{
+  static char long_name[701], names[4096];
+  char name[16];
+  int  i;
+
+  // Simple lists.
+  make( "cmd.exe;Perl.exe;less.exe", 0 );
+  check( "first", FIND( "cmd.exe" ) );
+  check( "middle, case", FIND( "PERL.EXE" ) );
+  check( "last", FIND( "Less.Exe" ) );
+  check( "missing", !FIND( "more.exe" ) );
+  check( "prefix", !FIND( "cmd" ) );
+  check( "longer", !FIND( "cmd.exe2" ) );
+  check( "empty value", !FIND( "" ) );
+
+  // Negation.
+  make( "!cmd.exe;perl.exe", 0 );
+  check( "! excludes", !FIND( "CMD.EXE" ) );
+  check( "! includes", FIND( "more.exe" ) );
+  make( "!", 0 );
+  check( "! alone", FIND( "anything.exe" ) );
+
+  // Empty lists.
+  pl_split( &list, NULL, 1 );
+  check( "no variable", !FIND( "cmd.exe" ) );
+  make( "", 0 );
+  check( "empty", !FIND( "cmd.exe" ) );
+  make( ";;", 0 );
+  check( "only separators", !FIND( "cmd.exe" ) && !FIND( "" ) );
+  make( ";cmd.exe;;perl.exe;", 0 );
+  check( "empty names", FIND( "cmd.exe" ) && FIND( "perl.exe" ) );
+
+  // Collisions: with many names, each must be found, and nothing else.
+  names[0] = '\0';
+  for (i = 0; i < 200; ++i)
+  {
+    sprintf( name, "%sprog%d.exe", (i) ? ";" : "", i );
+    strcat( names, name );
+  }
+  make( names, 0 );
+  for (i = 0; i < 200; ++i)
+  {
+    sprintf( name, "PROG%d.EXE", i );
+    check( "collisions (found)", FIND( name ) );
+    sprintf( name, "prog%d.exe", i + 200 );
+    check( "collisions (missing)", !FIND( name ) );
+  }
+
+  // Names that fold the same always collide, so each must be compared.
+  make( "FILE.EXE;file.exe", 0 );
+  compares = 0;
+  check( "Turkish i", FIND_CMP( "file.exe", cmp_turkish ) && compares == 2 );
+  check( "Turkish I", FIND_CMP( "FILE.EXE", cmp_turkish ) );
+  make( "FILE.EXE", 0 );
+  check( "Turkish I isn't i", !FIND_CMP( "file.exe", cmp_turkish ) );
+
+  // Names that aren't ASCII are compared with the comparison, not folding.
+  make( "perl.exe;f\x01" "0131le.exe", 0 );
+  check( "not ASCII", FIND_CMP( "FILE.EXE", cmp_turkish ) );
+  check( "not ASCII (ASCII still hashed)", FIND_CMP( "PERL.EXE", cmp_ascii ) );
+  make( "perl.exe;\x01" "212Aernel.exe", 0 );
+  check( "equated by the comparison", FIND_CMP( "kernel.exe", cmp_kelvin ) );
+  make( "perl.exe;kernel.exe", 0 );
+  check( "searching for non-ASCII",
+	 FIND_CMP( "\x01" "212Aernel.exe", cmp_kelvin ) );
+
+  // A long name (longer than MAX_PATH).
+  memset( long_name, 'a', 700 );
+  long_name[700] = '\0';
+  sprintf( names, "cmd.exe;%s", long_name );
+  make( names, 0 );
+  check( "long name", FIND( long_name ) );
+  long_name[699] = 'b';
+  check( "long name (missing)", !FIND( long_name ) );
+
+  // Without the table, every name is compared.
+  make( "cmd.exe;perl.exe", 1 );
+  check( "no table", FIND( "PERL.EXE" ) && !FIND( "more.exe" ) );
+
+  // Reading the list again when the variable changes.
+  list.gen = 0;
+  set_env( "cmd.exe;perl.exe" );
+  check( "read", search_env( "perl.exe" ) );
+  set_env( "more.exe" );
+  check( "same generation", search_env( "perl.exe" ) );
+  ++env_gen;
+  check( "new generation (added)", search_env( "more.exe" ) );
+  check( "new generation (removed)", !search_env( "perl.exe" ) );
+  set_env( "" );
+  ++env_gen;
+  check( "new generation (empty)", !search_env( "more.exe" ) );
+
+  if (failures == 0)
+    printf( "All passed.\n" );
+  return (failures != 0);
+}
@@ -0,0 +1,170 @@
+/*
+  scroll_test.c - Test moving a number of lines at once (scroll.h) against
+		  moving them one at a time.
+
+  Build and run with "make" in this directory.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../scroll.h"
+
+#define ROWS 32 		// most rows of the buffer
+#define BLANK 0
+
+int failures;
+
+void check( const char* name, int ok )
+{
+  if (!ok)
+  {
+    printf( "FAIL: %s\n", name );
+    ++failures;
+  }
+}
+
+
+// A buffer of rows, each just a number (BLANK when cleared).
+typedef struct
+{
+  int row[ROWS];
+  int y;
+} BUFFER;
+
+// Scroll lines TOP to BOTTOM by one, the old way.
+void scroll1( BUFFER* b, int top, int bottom, int up )
+{
+  int i;
+
+  if (up)
+  {
+    for (i = top; i < bottom; ++i)
+      b->row[i] = b->row[i+1];
+    b->row[bottom] = BLANK;
+  }
+  else
+  {
+    for (i = bottom; i > top; --i)
+      b->row[i] = b->row[i-1];
+    b->row[top] = BLANK;
+  }
+}
+
+// Move one line at a time (as MoveDown and MoveUp were).
+void one_at_a_time( BUFFER* b, const SCAREA* a, int n, int down )
+{
+  for (; n > 0; --n)
+  {
+    if (down)
+    {
+      if (a->margins && b->y == a->bottom)
+	scroll1( b, a->top, a->bottom, 1 );
+      else if (a->margins && b->y == a->win_bottom) ;
+      else if (b->y == a->last)
+	scroll1( b, 0, a->last, 1 );
+      else
+	++b->y;
+    }
+    else
+    {
+      if (a->margins && b->y == a->top)
+	scroll1( b, a->top, a->bottom, 0 );
+      else if (a->margins && b->y == a->win_top) ;
+      else if (b->y == 0)
+	scroll1( b, 0, a->last, 0 );
+      else
+	--b->y;
+    }
+  }
+}
+
+// Move all at once, scrolling as the console does: the lines are copied, those
+// moved from that weren't moved to are filled, then the rest cleared.
+void at_once( BUFFER* b, const SCAREA* a, int n, int down )
+{
+  SCMOVE   m;
+  SCSCROLL s;
+  int	   copy[ROWS], i;
+
+  if (down)
+    sc_down( a, b->y, n, &m );
+  else
+    sc_up( a, b->y, n, &m );
+  b->y = m.y;
+  if (m.n == 0)
+    return;
+
+  sc_scroll( m.top, m.bottom, m.n, &s );
+  if (s.from <= s.to)
+  {
+    memcpy( copy, b->row, sizeof(copy) );
+    for (i = s.from; i <= s.to; ++i)
+      if (i < s.dest || i > s.dest + s.to - s.from)
+	b->row[i] = BLANK;
+    for (i = s.from; i <= s.to; ++i)
+      b->row[s.dest + i - s.from] = copy[i];
+  }
+  for (i = 0; i < s.count; ++i)
+    b->row[s.clear + i] = BLANK;
+}
+
+
+int main( void )
+{
+  SCAREA   a;
+  SCSCROLL s;
+  BUFFER   one, all;
+  int	   t, i, n, down, fails = 0;
+
+  // Scrolling everything clears it.
+  sc_scroll( 2, 5, 4, &s );
+  check( "scroll all", s.from > s.to && s.clear == 2 && s.count == 4 );
+  sc_scroll( 2, 5, -9, &s );
+  check( "scroll more than all", s.from > s.to && s.clear == 2 && s.count == 4 );
+  sc_scroll( 0, 9, 3, &s );
+  check( "scroll less than half",
+	 s.from == 3 && s.to == 9 && s.dest == 0 && s.count <= 0 );
+  sc_scroll( 0, 9, -7, &s );
+  check( "scroll more than half",
+	 s.from == 0 && s.to == 2 && s.dest == 7 && s.clear == 3 && s.count == 4 );
+
+  // Random buffers, windows, margins, positions and counts.
+  srand( 1 );
+  for (t = 0; t < 200000; ++t)
+  {
+    a.last	 = 2 + rand() % (ROWS - 2);
+    a.win_top	 = rand() % (a.last + 1);
+    a.win_bottom = a.win_top + rand() % (a.last + 1 - a.win_top);
+    a.margins	 = rand() % 2;
+    a.top	 = a.win_top + rand() % (a.win_bottom - a.win_top + 1);
+    a.bottom	 = a.top + rand() % (a.win_bottom - a.top + 1);
+    for (i = 0; i < ROWS; ++i)
+      one.row[i] = i + 1;
+    // Mostly in the margins or the window, which is where it usually is.
+    switch (rand() % 3)
+    {
+      case 0:  one.y = a.top + rand() % (a.bottom - a.top + 1); break;
+      case 1:  one.y = a.win_top + rand() % (a.win_bottom - a.win_top + 1); break;
+      default: one.y = rand() % (a.last + 1); break;
+    }
+    all = one;
+    n = 1 + rand() % (2 * (a.last + 1) + 2);
+    down = rand() % 2;
+
+    one_at_a_time( &one, &a, n, down );
+    at_once( &all, &a, n, down );
+    if (one.y != all.y || memcmp( one.row, all.row, sizeof(one.row) ) != 0)
+    {
+      if (fails++ == 0)
+	printf( "  %s %d: last %d, window %d-%d, margins %d %d-%d\n",
+		(down) ? "down" : "up", n, a.last, a.win_top, a.win_bottom,
+		a.margins, a.top, a.bottom );
+    }
+  }
+  check( "at once", fails == 0 );
+
+  if (failures == 0)
+    printf( "All passed.\n" );
+  return (failures != 0);
+}
@@ -0,0 +1,510 @@
+/*
+  text_test.c - Test character widths and wrapping (text.h).
+
+  Build and run with "make" in this directory.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// As ANSI.c does.
+#if defined(__SSE2__)
+#define HAVE_SSE2
+#endif
+#include "../text.h"
+
+#define W 10			// line width
+
+int failures;
+
+// Cells given to combining, narrow and wide characters.
+const int* modern( void ) { static const int c[3] = {  0, 1,  2 }; return c; }
+const int* legacy( void ) { static const int c[3] = {  1, 1,  1 }; return c; }
+const int* dbcs( void )   { static const int c[3] = { -1, -1, 2 }; return c; }
+
+int asked;
+const int* counted( void ) { ++asked; return modern(); }
+
+
+void check( const char* name, int ok )
+{
+  if (!ok)
+  {
+    printf( "FAIL: %s\n", name );
+    ++failures;
+  }
+}
+
+
+// Check the wrap of TEXT from column X0 (to X,Y, or not known if X is -1).
+void wrap( const char* name, const unsigned short* text, int x0, int wrap,
+	   TXCELLS cells, int x, int y )
+{
+  int len, px = x0, py = -1, ok;
+
+  for (len = 0; text[len]; ++len) ;
+  ok = tx_wrap( text, len, &px, W, 1, wrap, 0, cells, &py, NULL );
+  if (x < 0)
+    check( name, !ok );
+  else
+  {
+    check( name, ok && px == x && py == y );
+    if (ok && (px != x || py != y))
+      printf( "  got %d,%d, expected %d,%d\n", px, py, x, y );
+  }
+}
+
+
+// A console of SW x SH cells, to compare jump scroll with writing the lines
+// one at a time.
+#define SW 10
+#define SH 5
+
+typedef struct
+{
+  unsigned short cell[SH][SW];
+  int x, y;
+  int wrapped, pend;		// as nWrapped & wrap_pend
+} SCREEN;
+
+void scr_scroll( SCREEN* s, int n )
+{
+  int y, x;
+
+  for (y = 0; y < SH; ++y)
+    for (x = 0; x < SW; ++x)
+      s->cell[y][x] = (y + n < SH) ? s->cell[y+n][x] : ' ';
+}
+
+void scr_pos( SCREEN* s, int x, int y )
+{
+  s->x = x;
+  s->y = y;
+  s->wrapped = s->pend = 0;
+}
+
+// WriteText: the console wraps at the margin, scrolling at the bottom.
+void scr_write( SCREEN* s, const unsigned short* text, int len )
+{
+  unsigned short c;
+
+  for (; len > 0; --len)
+  {
+    c = *text++;
+    if (c == '\r')
+    {
+      s->x = 0;
+      continue;
+    }
+    s->cell[s->y][s->x] = c;
+    if (c != ' ')
+      s->pend = 0;
+    if (++s->x == SW)
+    {
+      s->x = 0;
+      if (++s->y == SH)
+      {
+	scr_scroll( s, 1 );
+	s->y = SH - 1;
+      }
+      s->wrapped = s->pend = 1;
+    }
+  }
+}
+
+// new_line: the newline is dropped if only spaces followed a wrap.
+void scr_new_line( SCREEN* s )
+{
+  int nl = !(s->wrapped && s->pend);
+
+  s->x = 0;
+  s->wrapped = 0;
+  if (nl && ++s->y == SH)
+  {
+    scr_scroll( s, 1 );
+    s->y = SH - 1;
+  }
+}
+
+// write_lines, one at a time.
+void one_at_a_time( SCREEN* s, const unsigned short* text, int len )
+{
+  const unsigned short* end = text + len, * eol;
+
+  for (;; text = eol + 1)
+  {
+    for (eol = text; eol < end && *eol != '\n'; ++eol) ;
+    scr_write( s, text, (int)(eol - text) );
+    if (eol == end)
+      break;
+    scr_new_line( s );
+  }
+}
+
+// write_lines, jump scroll.
+int jump( SCREEN* s, const unsigned short* text, int len )
+{
+  const unsigned short* end = text + len, * next;
+  TXLINE line;
+  int	 rows, scroll, x, y;
+
+  rows = tx_jump_rows( text, len, s->x, SW, modern );
+  if (rows < 0)
+    return 0;
+  scroll = s->y + rows - (SH - 1);
+  if (scroll > 0)
+    scr_scroll( s, scroll );
+  else
+    scroll = 0;
+  x = s->x;
+  y = s->y - scroll;
+  for (; (next = tx_next_line( text, end, &x, &y, SW, &line )) != NULL;
+       text = next)
+  {
+    if (line.len > 0)
+    {
+      scr_pos( s, line.x, line.y );
+      scr_write( s, line.text, line.len );
+      if (s->y != line.y + (line.x + line.len) / SW)
+	return -1;			// it scrolled
+    }
+  }
+  scr_pos( s, 0, y );
+  if (text < end)
+    scr_write( s, text, (int)(end - text) );
+  return 1;
+}
+
+
+// Where the console leaves the cursor, writing a character at a time (with
+// the cells of a modern console).  DELAYED is the delayed wrap of VT
+// processing; *BLANK is the pending wrap (wrapped, then only spaces).
+void console( const unsigned short* text, int len, int processed, int wrap,
+	      int vt, int* px, int* py, int* blank )
+{
+  int x = *px, y = 0, delayed = 0, w;
+  unsigned short c;
+
+  for (; len > 0; --len)
+  {
+    c = *text++;
+    if (c < ' ' && processed)
+    {
+      if (c == '\r')
+	x = delayed = 0;
+      else if (c == '\b')
+      {
+	if (x > 0 && !delayed)
+	  --x;
+	delayed = 0;
+      }
+      else if (c == '\n')
+      {
+	x = delayed = 0;
+	++y;
+      }
+      else if (c == '\t')
+	x = (x | 7) + 1;
+      continue;
+    }
+    w = tx_cells( c, modern );
+    if (w > 0 && (delayed || (w == 2 && x + 2 > W && wrap)))
+    {
+      x = delayed = 0;
+      ++y;
+      *blank = 1;
+    }
+    if (c != ' ')
+      *blank = 0;
+    if (w <= 0)
+      continue;
+    if (x + w > W)
+      x = W - w;
+    if ((x += w) == W)
+    {
+      if (wrap && vt)
+      {
+	x = W - 1;
+	delayed = 1;
+      }
+      else if (wrap)
+      {
+	x = 0;
+	++y;
+	*blank = 1;
+      }
+      else
+	x = W - 1;
+    }
+  }
+  *px = x;
+  *py = y;
+}
+
+// Random text with the cursor known must be where the console puts it, with
+// the same pending wrap.
+void cursor( void )
+{
+  static const unsigned short chars[] =
+  {
+    'a', ' ', 0x00E9, ' ',
+    '\r', '\b', '\a', '\t', '\n', 0x4E00, 0x0301, 0x200B,
+  };
+  unsigned short text[32];
+  int n, len, i, processed, wrap, vt, x, y, cx, cy, x0, y0, pend0, pend, cpend;
+  int fails = 0, pend_fails = 0, track_fails = 0, known = 0, narrow;
+
+  srand( 2 );
+  for (n = 0; n < 200000; ++n)
+  {
+    len = 1 + rand() % 32;
+    narrow = rand() % 2;
+    for (i = 0; i < len; ++i)
+      text[i] = chars[rand() % ((narrow) ? 4 : 12)];
+    processed = (rand() % 4 != 0);
+    wrap = (rand() % 4 != 0);
+    vt = rand() % 2;
+    x0 = rand() % W;
+    pend0 = rand() % 2;
+    x = x0;
+    y = 5;
+    if (!tx_cursor( text, len, W, processed, wrap, vt, modern, &x, &y ))
+      continue;
+    ++known;
+    cx = x0;
+    cpend = pend0;
+    console( text, len, processed, wrap, vt, &cx, &cy, &cpend );
+    if (x != cx || y != 5 + cy)
+    {
+      if (fails++ == 0)
+	printf( "  text %d: got %d,%d, expected %d,%d\n", n, x, y - 5, cx, cy );
+    }
+
+    x = x0;
+    pend = pend0;
+    tx_wrap( text, len, &x, W, processed, wrap, vt, modern, &y0, &pend );
+    if (pend != cpend && pend_fails++ == 0)
+      printf( "  text %d: pending wrap %d, expected %d\n", n, pend, cpend );
+
+    // Without controls, the wrap can be found from where the cursor went.
+    if (narrow &&
+	tx_track_wrap( text, len, cx, cy > 0, vt, pend0 ) != cpend &&
+	track_fails++ == 0)
+      printf( "  text %d: tracked wrap %d, expected %d\n", n, !cpend, cpend );
+  }
+  check( "cursor", fails == 0 );
+  check( "cursor known", known > 50000 );
+  check( "pending wrap", pend_fails == 0 );
+  check( "tracked wrap", track_fails == 0 );
+}
+
+
+// Check the run of C with CTRL at each position (or none), for each length.
+void run( const char* name, unsigned short c, unsigned short ctrl )
+{
+  unsigned short text[40];
+  unsigned long  len, at, i, n, fails = 0;
+
+  for (len = 0; len <= 40; ++len)
+  {
+    for (at = 0; at <= len; ++at)
+    {
+      for (i = 0; i < len; ++i)
+	text[i] = (i == at) ? ctrl : c;
+      n = tx_run( text, len );
+      if (n != at && fails++ == 0)
+	printf( "  length %lu, control at %lu: got %lu\n", len, at, n );
+    }
+  }
+  check( name, fails == 0 );
+}
+
+
+// Random lines (with at least one newline) written both ways must leave the
+// same screen.
+void jump_scroll( void )
+{
+  static const char chars[] = "ab    ";
+  SCREEN one, jmp;
+  unsigned short text[256];
+  int	 n, len, lines, i, k, x, y, r, fails = 0;
+
+  srand( 1 );
+  for (n = 0; n < 100000; ++n)
+  {
+    len = 0;
+    lines = 1 + rand() % 8;
+    for (i = 0; i < lines; ++i)
+    {
+      for (k = rand() % 25; k > 0; --k)
+	text[len++] = chars[rand() % (sizeof(chars) - 1)];
+      if (rand() % 4 == 0)
+	text[len++] = '\r';
+      if (i < lines - 1 || lines == 1 || rand() % 2)
+	text[len++] = '\n';
+    }
+    for (y = 0; y < SH; ++y)
+      for (x = 0; x < SW; ++x)
+	one.cell[y][x] = 'a' + (y * SW + x) % 26;
+    scr_pos( &one, rand() % SW, rand() % SH );
+    jmp = one;
+
+    one_at_a_time( &one, text, len );
+    r = jump( &jmp, text, len );
+    if (r <= 0 || one.x != jmp.x || one.y != jmp.y ||
+	memcmp( one.cell, jmp.cell, sizeof(one.cell) ) != 0)
+    {
+      if (fails++ == 0)
+	printf( "  text %d: %s (%d,%d / %d,%d)\n", n,
+		(r < 0) ? "scrolled" : (r == 0) ? "not counted" : "differs",
+		one.x, one.y, jmp.x, jmp.y );
+    }
+  }
+  check( "jump scroll", fails == 0 );
+}
+
+
+int main( void )
+{
+  static const unsigned short
+    ascii[]	= { 'a','b','c','d','e', 0 },
+    wide[]	= { 0x4E00, 0x4E8C, 0 },	// two CJK ideographs
+    mixed[]	= { 'a', 0x4E00, 'b', 0xAC00, 0xFF21, 0 },
+    combining[] = { 'e', 0x0301, 'a', 0x0308, 0 },
+    latin[]	= { 0x00E9, 0x00FC, 0x0416, 0 },
+    controls[]	= { 'a','b','\r','c','\b','\a', 0 },
+    tab[]	= { 'a','\t', 0 },
+    unknown[]	= { 'a', 0xD83D, 0xDE00, 0 },	// surrogate pair
+    zwsp[]	= { 'a', 0x200B, 0 };
+
+  // Widths.
+  check( "width ASCII", tx_width( 'A' ) == 1 && tx_width( '~' ) == 1 );
+  check( "width DEL", tx_width( 0x7F ) == -1 );
+  check( "width Latin-1", tx_width( 0x00E9 ) == 1 );
+  check( "width box drawing", tx_width( 0x2500 ) == 1 );
+  check( "width CJK", tx_width( 0x4E00 ) == 2 && tx_width( 0x9FFF ) == 2 );
+  check( "width Hangul", tx_width( 0xAC00 ) == 2 && tx_width( 0xD7A3 ) == 2 );
+  check( "width kana", tx_width( 0x3042 ) == 2 && tx_width( 0x30A2 ) == 2 );
+  check( "width fullwidth", tx_width( 0xFF21 ) == 2 && tx_width( 0xFF61 ) == -1 );
+  check( "width ideographic space", tx_width( 0x3000 ) == 2 );
+  check( "width not wide", tx_width( 0x303F ) == -1 );
+  check( "width combining", tx_width( 0x0301 ) == 0 && tx_width( 0x20D7 ) == 0 );
+  check( "width surrogate", tx_width( 0xD800 ) == -1 );
+  check( "width zero width space", tx_width( 0x200B ) == -1 );
+
+  // ASCII.
+  wrap( "ASCII", ascii, 0, 1, modern, 5, 0 );
+  wrap( "ASCII to the last column", ascii, 4, 1, modern, 9, 0 );
+  wrap( "ASCII to the margin", ascii, 5, 1, modern, 0, 1 );
+  wrap( "ASCII past the margin", ascii, 7, 1, modern, 2, 1 );
+  wrap( "ASCII without wrap", ascii, 7, 0, modern, 9, 0 );
+  wrap( "controls", controls, 0, 1, modern, 0, 0 );
+  wrap( "controls at the margin", controls, 8, 1, modern, 0, 1 );
+  wrap( "tab", tab, 0, 1, modern, -1, 0 );
+
+  // CJK wide.
+  wrap( "wide", wide, 0, 1, modern, 4, 0 );
+  wrap( "wide to the margin", wide, 6, 1, modern, 0, 1 );
+  wrap( "wide at the last column", wide, 9, 1, modern, -1, 0 );
+  wrap( "wide split by the margin", wide, 7, 1, modern, -1, 0 );
+  wrap( "wide without wrap", wide, 6, 0, modern, 9, 0 );
+  wrap( "wide without room", wide, 7, 0, modern, -1, 0 );
+  wrap( "mixed", mixed, 0, 1, modern, 8, 0 );
+  wrap( "mixed to the margin", mixed, 2, 1, modern, 0, 1 );
+  wrap( "wide on a legacy console", wide, 9, 1, legacy, 1, 1 );
+  wrap( "wide in a DBCS code page", wide, 2, 1, dbcs, 6, 0 );
+
+  // Combining.
+  wrap( "combining", combining, 0, 1, modern, 2, 0 );
+  wrap( "combining at the last column", combining, 8, 1, modern, 0, 1 );
+  wrap( "combining on a legacy console", combining, 0, 1, legacy, 4, 0 );
+  wrap( "combining not known", combining, 0, 1, dbcs, -1, 0 );
+
+  // Other narrow characters.
+  wrap( "Latin", latin, 7, 1, modern, 0, 1 );
+  wrap( "Latin in a DBCS code page", latin, 0, 1, dbcs, -1, 0 );
+  wrap( "surrogates", unknown, 0, 1, modern, -1, 0 );
+  wrap( "zero width space", zwsp, 0, 1, modern, -1, 0 );
+
+  // Plain text.
+  check( "plain ASCII", tx_plain( ascii, 5, modern ) );
+  check( "plain Latin", tx_plain( latin, 3, modern ) );
+  check( "plain wide", !tx_plain( wide, 2, modern ) );
+  check( "plain wide on a legacy console", tx_plain( wide, 2, legacy ) );
+  check( "plain combining", !tx_plain( combining, 4, modern ) );
+  check( "plain controls", !tx_plain( controls, 6, modern ) );
+
+  // Runs of text.
+  run( "run ASCII", 'a', '\n' );
+  run( "run space", ' ', 0x1F );
+  run( "run NUL", '~', 0 );
+  run( "run DEL", 0x7F, 0x1B );
+  run( "run high", 0x8000, 0x01 );
+  run( "run highest", 0xFFFF, '\r' );
+  run( "run wide", 0x4E00, '\a' );
+
+  // The cursor after text.
+  {
+    static const unsigned short wrap_cr[] = { 'a','b','\r','c', 0 };
+    int x = 5, y = 3;
+    check( "cursor", tx_cursor( ascii, 5, W, 1, 1, 0, modern, &x, &y ) &&
+		     x == 0 && y == 4 );
+    x = 5, y = 3;
+    check( "cursor delayed wrap",
+	   !tx_cursor( ascii, 5, W, 1, 1, 1, modern, &x, &y ) && x == 5 && y == 3 );
+    x = 6;
+    check( "cursor VT", tx_cursor( ascii, 5, W, 1, 1, 1, modern, &x, &y ) &&
+			x == 1 && y == 4 );
+    x = 8, y = 3;
+    check( "cursor wrap and CR",
+	   tx_cursor( wrap_cr, 4, W, 1, 1, 0, modern, &x, &y ) &&
+	   x == 1 && y == 4 );
+    x = 8, y = 3;
+    check( "cursor VT wrap and CR",
+	   tx_cursor( wrap_cr, 4, W, 1, 1, 1, modern, &x, &y ) &&
+	   x == 1 && y == 3 );
+  }
+  cursor();
+
+  // Runs of newlines.
+  {
+    static const unsigned short
+      nl[] = { '\n','\r','\n','\n','a','\n', 0 },
+      cr[] = { '\r','\n','\r','\r','a', 0 };
+    unsigned long last;
+    check( "newlines", tx_newlines( nl, 6, &last ) == 3 && last == 4 );
+    check( "newlines to the end", tx_newlines( nl, 3, &last ) == 2 && last == 3 );
+    check( "newlines with CRs", tx_newlines( cr, 5, &last ) == 1 && last == 2 );
+    check( "no newlines", tx_newlines( ascii, 5, &last ) == 0 && last == 0 );
+    check( "newlines of nothing", tx_newlines( nl, 0, &last ) == 0 );
+  }
+
+  // Jump scroll.
+  check( "jump rows", tx_jump_rows( ascii, 5, 0, W, modern ) == 0 );
+  {
+    static const unsigned short
+      lines[]  = { 'a','\n','b','c','\r','\n','d', 0 },
+      margin[] = { 'a','b','c','d','e','f','g','h','i','j','\n', 0 },
+      spaces[] = { 'a','b','c','d','e','f','g','h','i','j',' ',' ','\n', 0 },
+      tabbed[] = { 'a','\t','\n', 0 };
+    check( "jump rows lines", tx_jump_rows( lines, 7, 0, W, modern ) == 2 );
+    check( "jump rows margin", tx_jump_rows( margin, 11, 0, W, modern ) == 1 );
+    check( "jump rows spaces", tx_jump_rows( spaces, 13, 0, W, modern ) == 1 );
+    check( "jump rows wrapped", tx_jump_rows( lines, 7, 9, W, modern ) == 2 );
+    check( "jump rows tab", tx_jump_rows( tabbed, 3, 0, W, modern ) == -1 );
+    check( "jump rows wide", tx_jump_rows( mixed, 5, 0, W, modern ) == 0 );
+  }
+  jump_scroll();
+
+  // The console is only asked about non-ASCII.
+  asked = 0;
+  wrap( "ASCII not asked", ascii, 0, 1, counted, 5, 0 );
+  check( "ASCII not asked", asked == 0 );
+  wrap( "wide asked", wide, 0, 1, counted, 4, 0 );
+  check( "wide asked", asked == 2 );
+
+  if (failures == 0)
+    printf( "All passed.\n" );
+  return (failures != 0);
+}
@@ -0,0 +1,388 @@
+/*
+  text.h - How text fills the cells of a console line.
+
+  Used by ANSI.c to work out where text will take the cursor, without asking
+  the console.  There's nothing Windows-specific here, so it can be tested
+  elsewhere (see tests/text_test.c).  Finding a run of text uses SSE2 if
+  HAVE_SSE2 is defined.
+*/
+
+#ifndef TEXT_H
+#define TEXT_H
+
+#ifdef HAVE_SSE2
+#include <emmintrin.h>
+#endif
+
+// Characters (beyond ASCII) known to take a single cell.
+static const unsigned short tx_narrow[][2] =
+{
+  { 0x00A0, 0x02FF },	// Latin-1, Latin Extended, IPA, modifiers
+  { 0x0370, 0x0482 },	// Greek, Cyrillic (without its combining marks)
+  { 0x048A, 0x0590 },	// Cyrillic Supplement, Armenian
+  { 0x1E00, 0x1FFF },	// Latin Extended Additional, Greek Extended
+  { 0x2010, 0x2027 },	// punctuation (not the zero-width characters)
+  { 0x2030, 0x205E },
+  { 0x2070, 0x20CF },	// super- & subscripts, currency
+  { 0x2100, 0x2319 },	// letterlike, number forms, arrows, math, technical
+  { 0x2500, 0x25FC },	// box drawing, block elements, geometric shapes
+};
+
+// East Asian Wide and Fullwidth characters (Unicode's EastAsianWidth.txt, W
+// and F), which take two cells.
+static const unsigned short tx_wide[][2] =
+{
+  { 0x1100, 0x115F },	// Hangul Jamo leading consonants
+  { 0x2329, 0x232A },	// angle brackets
+  { 0x2E80, 0x303E },	// CJK radicals, Kangxi, ideographic description,
+			//  CJK symbols & punctuation
+  { 0x3041, 0x33FF },	// kana, Bopomofo, Hangul compatibility Jamo, Kanbun,
+			//  enclosed & compatibility CJK
+  { 0x3400, 0x4DBF },	// CJK Unified Ideographs Extension A
+  { 0x4E00, 0x9FFF },	// CJK Unified Ideographs
+  { 0xA000, 0xA4CF },	// Yi
+  { 0xAC00, 0xD7A3 },	// Hangul syllables
+  { 0xF900, 0xFAFF },	// CJK compatibility ideographs
+  { 0xFE10, 0xFE19 },	// vertical forms
+  { 0xFE30, 0xFE6F },	// CJK compatibility forms, small form variants
+  { 0xFF00, 0xFF60 },	// fullwidth forms
+  { 0xFFE0, 0xFFE6 },
+};
+
+// Combining marks, which take no cell of their own.
+static const unsigned short tx_combining[][2] =
+{
+  { 0x0300, 0x036F },	// combining diacritical marks
+  { 0x0483, 0x0489 },	// Cyrillic
+  { 0x1AB0, 0x1AFF },	// combining diacritical marks extended
+  { 0x1DC0, 0x1DFF },	// combining diacritical marks supplement
+  { 0x20D0, 0x20FF },	// combining marks for symbols
+  { 0xFE20, 0xFE2F },	// combining half marks
+};
+
+
+#define TX_IN( r, c ) tx_in( r, sizeof(r) / sizeof(*(r)), c )
+
+static int tx_in( const unsigned short (*r)[2], int n, unsigned short c )
+{
+  int i;
+
+  for (i = 0; i < n; ++i)
+    if (c >= r[i][0] && c <= r[i][1])
+      return 1;
+  return 0;
+}
+
+
+// The width of a printable character: 1 (narrow), 2 (wide), 0 (combining) or
+// -1 if it's not known (zero width, surrogates, everything else).
+static int tx_width( unsigned short c )
+{
+  if (c >= ' ' && c < 0x7F)
+    return 1;
+  if (TX_IN( tx_narrow, c ))
+    return 1;
+  if (TX_IN( tx_wide, c ))
+    return 2;
+  if (TX_IN( tx_combining, c ))
+    return 0;
+  return -1;
+}
+
+
+// How many cells the console gives a non-ASCII character of each width (it
+// depends on the code page, font and version), with -1 if that's not known.
+// It's only asked for when there is such a character.
+typedef const int* (*TXCELLS)( void );
+
+// The cells a character takes (a control being shown as a glyph).  Returns -1
+// if it's not known.
+static int tx_cells( unsigned short c, TXCELLS cells )
+{
+  int w;
+
+  if (c < 0x7F)
+    return 1;
+  w = tx_width( c );
+  return (w < 0) ? -1 : cells()[w];
+}
+
+
+// Work out where writing the text from column *X of a line WIDTH wide will
+// take the cursor (as the console does it, without interpreting sequences):
+// *Y is the number of lines it wrapped, *X the final column.  Controls are
+// only CR, BS and BEL (if PROCESSED); without WRAP the cursor stays at the
+// margin.  With VT processing (VT) the wrap at the margin is delayed until the
+// next character, so a CR stays on the line.  If PEND isn't NULL, it's the
+// pending wrap: set when the text wraps, cleared by anything but a space (as
+// new_line uses it).  Returns 0 if it can't be known (leave it to the console),
+// including a wide character that doesn't fit at the end of the line and text
+// ending with a delayed wrap.
+static int tx_wrap( const unsigned short* text, int len, int* px, int width,
+		    int processed, int wrap, int vt, TXCELLS cells, int* py,
+		    int* pend )
+{
+  int x = *px, y = 0, n, delayed = 0;
+  int blank = (pend != NULL && *pend);
+  unsigned short c;
+
+  for (; len > 0; --len)
+  {
+    c = *text++;
+    if (c < ' ' && processed)
+    {
+      if (c == '\r')
+      {
+	x = 0;
+	if (delayed)
+	{
+	  --y;
+	  delayed = 0;
+	}
+      }
+      else if (c == '\b' && x > 0)
+	--x;
+      else if (c != '\a')
+	return 0;		// TAB, LF, or BS at the margin
+      continue;
+    }
+    n = tx_cells( c, cells );
+    if (n < 0 || (n == 2 && x + 2 > width))
+      return 0;
+    if (n > 0 && delayed)
+    {
+      delayed = 0;
+      blank = 1;
+    }
+    if (c != ' ')
+      blank = 0;
+    if ((x += n) == width)
+    {
+      if (wrap)
+      {
+	x = 0;
+	++y;
+	if (vt)
+	  delayed = 1;
+	else
+	  blank = 1;
+      }
+      else
+	x = width - 1;
+    }
+  }
+  if (delayed)
+    return 0;
+  *px = x;
+  *py = y;
+  if (pend != NULL)
+    *pend = blank;
+  return 1;
+}
+
+
+// Keep track of the pending wrap when the console had to say where the text
+// went (tx_wrap knows it when the text can be predicted).  X is the column the
+// text left the cursor and WRAPPED is if it wrapped to get there, from the
+// pending wrap PEND.  The last X characters are taken to be those after the
+// wrap, which is right for narrow characters without BS.  Returns the new
+// pending wrap.
+static int tx_track_wrap( const unsigned short* text, int len, int x,
+			  int wrapped, int vt, int pend )
+{
+  if (wrapped)
+  {
+    // VT processing delays the wrap at the margin, leaving the cursor there.
+    if (x == 0 && vt)
+      return 0;
+    if (len < x)
+      return 0;
+    text += len - x;
+    len = x;
+    pend = 1;
+  }
+  for (; pend && len > 0; --len, ++text)
+  {
+    if (*text != ' ' && *text != '\r' && *text != '\a')
+      pend = 0;
+  }
+  return pend;
+}
+
+
+// Where writing the text takes the cursor from column *X of row *Y (see
+// tx_wrap).  Returns 0 if it can't be known.
+static int tx_cursor( const unsigned short* text, int len, int width,
+		      int processed, int wrap, int vt, TXCELLS cells,
+		      int* x, int* y )
+{
+  int px = *x, py;
+
+  if (!tx_wrap( text, len, &px, width, processed, wrap, vt, cells, &py, NULL ))
+    return 0;
+  *x = px;
+  *y += py;
+  return 1;
+}
+
+
+// Determine if text is only printable characters, each taking one cell.
+static int tx_plain( const unsigned short* text, int len, TXCELLS cells )
+{
+  for (; len > 0; --len, ++text)
+    if (*text < ' ' || tx_cells( *text, cells ) != 1)
+      return 0;
+  return 1;
+}
+
+
+// The number of characters before the first control (or LEN if there's none).
+static unsigned long tx_run( const unsigned short* s, unsigned long len )
+{
+  unsigned long n = 0;
+
+#ifdef HAVE_SSE2
+  // Subtracting 31 with unsigned saturation leaves zero for the controls.
+  const __m128i ctrl = _mm_set1_epi16( 0x1F );
+  const __m128i zero = _mm_setzero_si128();
+  for (; n + 8 <= len; n += 8)
+  {
+    __m128i v = _mm_loadu_si128( (const __m128i*)(s + n) );
+    if (_mm_movemask_epi8( _mm_cmpeq_epi16( _mm_subs_epu16( v, ctrl ), zero ) ))
+      break;
+  }
+#endif
+  while (n < len && s[n] >= ' ')
+    ++n;
+
+  return n;
+}
+
+// The number of newlines in the run of newlines and CRs at the start of S (LEN
+// characters).  *LAST is set to the index after the last newline.
+static unsigned long tx_newlines( const unsigned short* s, unsigned long len,
+				  unsigned long* last )
+{
+  unsigned long j, n = 0;
+
+  *last = 0;
+  for (j = 0; j < len && (s[j] == '\n' || s[j] == '\r'); ++j)
+  {
+    if (s[j] == '\n')
+    {
+      ++n;
+      *last = j + 1;
+    }
+  }
+  return n;
+}
+
+
+// The rows a line of N plain characters from column X takes, with its newline.
+// If the line wrapped and only spaces followed, the wrap takes the newline (as
+// new_line does).
+static int tx_line_rows( const unsigned short* p, int x, int n, int width )
+{
+  int rows = (x + n) / width;
+  int i;
+
+  if (rows == 0)
+    return 1;
+  for (i = n - (x + n) % width; i < n && p[i] == ' '; ++i) ;
+  return (i == n) ? rows : rows + 1;
+}
+
+
+// The length of the line at P (before END), without its CR.  *EOL is set to
+// its newline (END if there's none).
+static int tx_line( const unsigned short* p, const unsigned short* end,
+		    const unsigned short** eol )
+{
+  const unsigned short* e;
+  int n;
+
+  for (e = p; e < end && *e != '\n'; ++e) ;
+  *eol = e;
+  n = (int)(e - p);
+  if (n > 0 && p[n-1] == '\r')
+    --n;
+  return n;
+}
+
+
+// The rows taken by the lines of text written from column X (jump scroll), not
+// counting the text after the last newline (which is written as usual).  The
+// lines must be plain, apart from a CR at the end.  Returns -1 if they can't
+// be counted.
+static int tx_jump_rows( const unsigned short* text, int len, int x,
+			 int width, TXCELLS cells )
+{
+  const unsigned short* end = text + len, * eol;
+  int n, rows = 0;
+
+  for (;; text = eol + 1)
+  {
+    n = tx_line( text, end, &eol );
+    if (eol == end)
+      break;
+    if (!tx_plain( text, n, cells ))
+      return -1;
+    rows += tx_line_rows( text, x, n, width );
+    x = 0;
+  }
+  return rows;
+}
+
+
+// A line of jump scroll: what's visible of it, and where that's written.
+typedef struct
+{
+  const unsigned short* text;
+  int len;			// 0 if none of it is visible
+  int x, y;
+} TXLINE;
+
+// Get the line at TEXT (before END), which starts at column *X of row *Y (the
+// rows having already been scrolled, so it may be above the top, row 0).
+// Returns the start of the next line, with *X and *Y moved to it, or NULL if
+// there's no newline (the rest of the text is written as usual, at the start
+// of row *Y).
+static const unsigned short* tx_next_line( const unsigned short* text,
+					   const unsigned short* end,
+					   int* x, int* y, int width,
+					   TXLINE* line )
+{
+  const unsigned short* eol;
+  int n, skip;
+
+  n = tx_line( text, end, &eol );
+  if (eol == end)
+    return NULL;
+
+  // The row of the last character.
+  line->len = 0;
+  if (*y + (*x + n - 1) / width >= 0 && n > 0)
+  {
+    if (*y < 0)
+    {
+      // Only the end of the line remains.
+      skip = -*y * width - *x;
+      line->text = text + skip;
+      line->len  = n - skip;
+      line->x	 = 0;
+      line->y	 = 0;
+    }
+    else
+    {
+      line->text = text;
+      line->len  = n;
+      line->x	 = *x;
+      line->y	 = *y;
+    }
+  }
+  *y += tx_line_rows( text, *x, n, width );
+  *x = 0;
+  return eol + 1;
+}
+
+#endif